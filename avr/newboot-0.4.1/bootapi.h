@@ -0,0 +1,288 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   bootapi.h: Definitions shared between the boot loader and applications
+
+   This file does not depend on the boot loader configuration, so it can
+   be included by application code as-is.
+
+*/
+
+#ifndef BOOTAPI_H
+#define BOOTAPI_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/* ---- EEPROM ---- */
+
+/* The boot loader reserves the last BOOT_EEPROM_SIZE bytes of the     */
+/* EEPROM for its own use. Applications must not write to this area,  */
+/* even if the boot loader was compiled without the features using it. */
+#define BOOT_EEPROM_SIZE   128
+#define BOOT_EEPROM_START  (E2END + 1 - BOOT_EEPROM_SIZE)
+
+/* Update journal (CONFIG_UPDATE_JOURNAL) */
+#define EE_JOURNAL_HEADER  (BOOT_EEPROM_START + 0)   /* 16 bytes */
+#define EE_JOURNAL_SLOTS   (BOOT_EEPROM_START + 16)  /* 48 bytes */
+
+/* Update request (CONFIG_UPDATE_GATE) */
+/* An application that wants the boot loader to search the card on */
+/* the next reset writes UPDATE_REQUEST_MAGIC to this byte. The     */
+/* boot loader resets it to 0xff when it has seen the request.      */
+#define EE_UPDATE_REQUEST  (BOOT_EEPROM_START + 64)  /* 1 byte */
+#define UPDATE_REQUEST_MAGIC 0x5a
+
+/* Deadline overruns (CONFIG_BOOT_DEADLINE) */
+/* Number of searches that were abandoned because they reached the   */
+/* deadline with a valid application in flash, 0xffff if there was   */
+/* none yet, and how the last one ended. Applications may read them. */
+#define EE_DEADLINE_OVERRUNS (BOOT_EEPROM_START + 66)  /* 2 bytes */
+#define EE_DEADLINE_REASON   (BOOT_EEPROM_START + 68)  /* 1 byte */
+#define DEADLINE_POLLED      1   /* noticed between two directory entries */
+#define DEADLINE_WATCHDOG    2   /* ended by a watchdog reset */
+
+/* SD trace request (CONFIG_SD_TRACE without CONFIG_SD_TRACE_BAUD) */
+/* An application that wants the trace of the next search in the   */
+/* EEPROM writes TRACE_REQUEST_MAGIC to this byte. The boot loader  */
+/* resets it to 0xff when it has written the trace.                 */
+#define EE_TRACE_REQUEST   (BOOT_EEPROM_START + 69)  /* 1 byte */
+#define TRACE_REQUEST_MAGIC 0x54
+
+/* Update mailbox (CONFIG_UPDATE_MAILBOX) */
+/* An application that has already found an update on the card can   */
+/* pass its location to the boot loader, which then skips the search */
+/* of the root directory. The FAT fields are copied from the FATFS    */
+/* structure of a mounted card, crc is the CRC-CCITT (start value     */
+/* 0xffff) of all fields before it. The boot loader invalidates the   */
+/* mailbox when it reads it, successful or not.                       */
+#define EE_UPDATE_MAILBOX  (BOOT_EEPROM_START + 72)  /* 32 bytes */
+#define MAILBOX_MAGIC      0x4d42
+
+typedef struct {
+  uint16_t magic;      /* MAILBOX_MAGIC */
+  uint32_t clust;      /* Start cluster of the image file */
+  uint32_t fsize;      /* Size of the image file */
+  uint32_t fatbase;    /* FATFS.fatbase */
+  uint32_t database;   /* FATFS.database */
+  uint32_t max_clust;  /* FATFS.max_clust */
+  uint8_t  csize;      /* FATFS.csize */
+  uint8_t  fs_type;    /* FATFS.fs_type */
+  uint16_t tag_crc;    /* crc field of the tag of the image */
+  uint16_t crc;        /* CRC of the mailbox */
+} update_mailbox_t;
+
+/* Directory position hint (CONFIG_DIR_HINT) */
+#define EE_DIR_HINT        (BOOT_EEPROM_START + 104) /* 24 bytes */
+
+/* Card probe results (CONFIG_CARD_PROBE) */
+/* A boot loader built with CONFIG_CARD_PROBE measures the card when */
+/* it finds a probe request and stores the results in the            */
+/* CARD_PROBE_SIZE bytes below BOOT_EEPROM_START, which such builds  */
+/* reserve in addition. Times are Timer 1 counts at the prescaler    */
+/* given for each field, 0xffff if the timer overflowed or the       */
+/* command failed. crc is the CRC-CCITT (start value 0xffff) of all  */
+/* fields before it.                                                 */
+#define CARD_PROBE_SIZE      64
+#define EE_CARD_PROBE        (BOOT_EEPROM_START - CARD_PROBE_SIZE)
+#define CARD_PROBE_MAGIC     0x5043
+#define CARD_PROBE_DIVIDERS  7   /* SPI clocks F_CPU/2 to F_CPU/128 */
+#define CARD_PROBE_SECTORS   4   /* sectors read in each test */
+
+typedef struct card_probe {
+  uint16_t magic;      /* CARD_PROBE_MAGIC */
+  uint8_t  size;       /* sizeof(card_probe_t) */
+  uint8_t  cardtype;   /* card type from disk_initialize, 0xff if it failed */
+  uint16_t cpu_khz;    /* F_CPU / 1000 */
+  uint16_t init_time;  /* disk_initialize, prescaler 1024 */
+  uint16_t token_max;  /* longest wait for the READ_SINGLE_BLOCK data token, prescaler 8 */
+  uint16_t token_sum;  /* sum of the waits over CARD_PROBE_SECTORS reads, prescaler 8 */
+  uint16_t read_time[CARD_PROBE_DIVIDERS]; /* READ_MULTIPLE_BLOCK of CARD_PROBE_SECTORS */
+                                           /* at F_CPU/(2<<n) without the CRC check, */
+                                           /* prescaler 64                           */
+  uint8_t  errors;     /* bit n set if the read at F_CPU/(2<<n) failed or had a bad CRC */
+  uint8_t  fastest;    /* smallest n that worked along with all slower clocks, */
+                       /* CARD_PROBE_DIVIDERS if even the slowest failed       */
+  uint8_t  cid[16];    /* CID register, 0 if it could not be read */
+  uint16_t crc;        /* CRC of the results */
+} card_probe_t;
+
+/* SD command trace (CONFIG_SD_TRACE) */
+/* A boot loader built with CONFIG_SD_TRACE keeps the last            */
+/* SD_TRACE_ENTRIES commands sent to the card during a search in RAM  */
+/* and writes them out on request: to the USART if                    */
+/* CONFIG_SD_TRACE_BAUD is set (see README), else the newest          */
+/* SD_TRACE_EE_ENTRIES to the SD_TRACE_SIZE bytes below the card      */
+/* probe results after EE_TRACE_REQUEST was set. Such builds reserve  */
+/* this area in addition. A written trace is an sd_trace_dump_t, its  */
+/* entries from the oldest to the newest and the CRC-CCITT (start     */
+/* value 0xffff) of all bytes before it. time is Timer 1 at prescaler */
+/* 1024 and wraps around.                                             */
+#define SD_TRACE_SIZE      256
+#define EE_SD_TRACE        (BOOT_EEPROM_START - CARD_PROBE_SIZE - SD_TRACE_SIZE)
+#define SD_TRACE_MAGIC     0x5453
+#define SD_TRACE_ENTRIES   64
+#define SD_TRACE_EE_ENTRIES \
+  ((SD_TRACE_SIZE - sizeof(sd_trace_dump_t) - 2) / sizeof(sd_trace_entry_t))
+
+typedef struct {
+  uint8_t  cmd;        /* command byte, 0x40 + command index */
+  uint8_t  r1;         /* R1 response, bit 7 set if the card did not answer */
+  uint8_t  spi;        /* SPI clock: SPR1/SPR0 in bits 0-1, SPI2X in bit 2 */
+  uint32_t arg;        /* command argument */
+  uint16_t wait;       /* bytes read before the data token, 0 without data */
+  uint16_t time;       /* Timer 1 when the command was sent */
+} sd_trace_entry_t;
+
+typedef struct {
+  uint16_t magic;      /* SD_TRACE_MAGIC */
+  uint16_t cpu_khz;    /* F_CPU / 1000 */
+  uint16_t count;      /* commands traced, saturates at 0xffff */
+  uint8_t  entries;    /* entries that follow */
+  uint8_t  cardtype;   /* card type from disk_initialize */
+} sd_trace_dump_t;
+
+/* the trace in RAM, kept over a watchdog reset */
+typedef struct sd_trace {
+  uint16_t magic;      /* SD_TRACE_MAGIC */
+  uint16_t count;      /* commands traced, saturates at 0xffff */
+  uint8_t  next;       /* entry for the next command, the oldest one */
+                       /* once count reached SD_TRACE_ENTRIES        */
+  uint8_t  cardtype;   /* card type from disk_initialize */
+  sd_trace_entry_t entry[SD_TRACE_ENTRIES];
+} sd_trace_t;
+
+
+/* ---- RAM ---- */
+
+/* The boot loader keeps its own variables out of the first          */
+/* BOOT_RAM_SIZE bytes of the RAM, so an application can leave        */
+/* information there for the boot loader before it resets the chip.  */
+/* An application that reads the card handoff must keep this area    */
+/* free as well, e.g. by linking with -Wl,--section-start=.data=...  */
+/* at RAMSTART + BOOT_RAM_SIZE.                                      */
+#define BOOT_RAM_SIZE      64
+#define BOOT_RAM_START     RAMSTART
+
+/* Warm start handshake (CONFIG_WARM_START) */
+/* An application that has initialized the card through the service  */
+/* table and left it in transfer state can store the card type that   */
+/* disk_initialize returned here before resetting the chip with the   */
+/* watchdog. The boot loader then only checks the status of the card  */
+/* at full SPI speed instead of initializing it again, a failed check */
+/* falls back to the full initialization. The boot loader clears      */
+/* magic when it has seen the handshake.                              */
+#define WARM_START_MAGIC   0x5357
+
+typedef struct {
+  uint16_t magic;      /* WARM_START_MAGIC */
+  uint8_t  cardtype;   /* card type from disk_initialize */
+  uint8_t  check;      /* ~cardtype */
+} warm_start_t;
+
+#define BOOT_WARM_START    ((warm_start_t *)BOOT_RAM_START)
+
+/* Card handoff (CONFIG_CARD_HANDOFF) */
+/* Before starting the application the boot loader describes the card */
+/* it used in the last search here. If HANDOFF_SPI_LIVE is set, the   */
+/* SPI interface is still enabled with the settings below and the     */
+/* card is in transfer state with a block length of 512, so the       */
+/* application can use disk_read (or its own driver) right away. If   */
+/* HANDOFF_MOUNTED is set, the FAT fields can be copied into a FATFS   */
+/* structure instead of calling f_mount. crc is the CRC-CCITT (start  */
+/* value 0xffff) of all fields before it. The application should      */
+/* clear magic after reading the handoff.                             */
+#define HANDOFF_MAGIC      0x4f48
+#define HANDOFF_VERSION    1
+
+#define HANDOFF_SPI_LIVE   0x01  /* SPI left configured, card in transfer state */
+#define HANDOFF_CID        0x02  /* cid is valid */
+#define HANDOFF_MOUNTED    0x04  /* FAT fields are valid */
+
+typedef struct {
+  uint16_t magic;      /* HANDOFF_MAGIC */
+  uint8_t  version;    /* HANDOFF_VERSION, fields are only ever appended */
+  uint8_t  size;       /* sizeof(boot_handoff_t) */
+  uint8_t  flags;      /* HANDOFF_* */
+  uint8_t  cardtype;   /* card type for disk_read, FATFS.drive */
+  uint8_t  spcr;       /* SPCR */
+  uint8_t  spsr;       /* SPSR, SPI2X */
+  uint8_t  cid[16];    /* CID register of the card */
+  uint32_t fatbase;    /* FATFS.fatbase */
+  uint32_t dirbase;    /* FATFS.dirbase */
+  uint32_t database;   /* FATFS.database */
+  uint32_t max_clust;  /* FATFS.max_clust */
+  uint32_t sects_fat;  /* FATFS.sects_fat */
+  uint16_t n_rootdir;  /* FATFS.n_rootdir */
+  uint8_t  csize;      /* FATFS.csize */
+  uint8_t  fs_type;    /* FATFS.fs_type */
+  uint8_t  n_fats;     /* FATFS.n_fats */
+  uint16_t crc;        /* CRC of the handoff */
+} boot_handoff_t;
+
+#define BOOT_HANDOFF       ((boot_handoff_t *)(BOOT_RAM_START + sizeof(warm_start_t)))
+
+
+/* ---- Service table (CONFIG_SERVICE_TABLE) ---- */
+
+/* The service table at the end of the flash starts with a magic word,
+   a version byte and the number of entries, followed by the word
+   addresses of the exported functions. Entries are only ever appended,
+   so applications can rely on an entry if version and count are large
+   enough. Use pgm_read_word_far on chips with more than 64K flash.
+
+   The functions take and return the types from newboot's ff.h and
+   diskio.h, compiled with -funsigned-char -fpack-struct -fshort-enums.
+   They do not use any static variables, all state is kept in objects
+   supplied by the application - FATFS includes the 512 byte sector
+   buffer. The card type returned by disk_initialize must be passed to
+   disk_read, f_mount stores it in FATFS.drive. f_readdir does not
+   return file names, only size and start cluster. */
+#define SVC_TABLE_SIZE   0x40
+#define SVC_TABLE_ADDR   (FLASHEND + 1UL - SVC_TABLE_SIZE)
+#define SVC_MAGIC        0x424e
+#define SVC_VERSION      1
+
+#define SVC_DISK_INITIALIZE  0  /* DSTATUS disk_initialize(BYTE *type)                  */
+#define SVC_DISK_READ        1  /* DRESULT disk_read(BYTE type, BYTE *buf, DWORD sector) */
+#define SVC_F_MOUNT          2  /* FRESULT f_mount(BYTE drv, FATFS *fs)                 */
+#define SVC_L_OPENROOT       3  /* FRESULT l_openroot(FATFS *fs, DIR *dj)               */
+#define SVC_F_READDIR        4  /* FRESULT f_readdir(DIR *dj, FILINFO *fi)              */
+#define SVC_L_OPENFILE       5  /* FRESULT l_openfile(FATFS *fs, FILINFO *fi, FIL *fp)  */
+#define SVC_F_READ           6  /* FRESULT f_read(FIL *fp, void *buf, UINT len)         */
+#define SVC_F_LSEEK          7  /* FRESULT f_lseek(FIL *fp, DWORD ofs)                  */
+#define SVC_CRC_CCITT_BLOCK  8  /* uint16_t crc_ccitt_block(uint16_t crc, const void *data, uint16_t len) */
+#define SVC_COUNT            9
+
+/* Flash address of the table entry for a function */
+#define SVC_ENTRY_ADDR(n)    (SVC_TABLE_ADDR + 4 + 2 * (n))
+
+#endif
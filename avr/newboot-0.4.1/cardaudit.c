@@ -0,0 +1,403 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   cardaudit.c: Predicts what the boot loader does with a set of cards
+
+   The cards are read with the boot loader's own ff.c and searched with
+   img_select from imagecheck.h, the function main.c uses, so the result
+   and the number of sectors read match those of the boot loader.
+   Mailbox, journal, directory hint and delta files depend on the state
+   of the device and are not modelled.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+#include "ff.h"
+#include "hostdisk.h"
+#include "imagecheck.h"
+
+#define MAX_LENGTH   0x1000000UL
+#define MAX_THREADS  256
+#define REPORT_SIZE  4096
+
+struct card {
+  const char     *name;
+  struct hostcard disk;
+  int             chosen;
+  int             unreadable;
+  size_t          used;
+  char            report[REPORT_SIZE];
+};
+
+static const char *reasons[] = {
+  [IMG_OK]     = "ok",
+  [IMG_READ]   = "read error",
+  [IMG_CRC]    = "bad CRC",
+  [IMG_DEVICE] = "wrong device ID",
+  [IMG_LENGTH] = "size does not match the length field",
+  [IMG_SAME]   = "development build already in flash",
+  [IMG_OLDER]  = "version not newer than flash",
+  [IMG_FORMAT] = "not a bundle",
+  [IMG_BELOW]  = "ranks below the best file",
+};
+
+/* settings of the simulated boot loader */
+static unsigned long length, devid;
+static uint8_t  varlen, single_pass, raw_partition, bundles;
+static uint16_t flash_version = 0xffff, flash_crc = 0xffff;
+
+static struct card *cards;
+static unsigned int card_count, next_card;
+
+/* append a line to the report of a card */
+static void report(struct card *c, const char *fmt, ...) {
+  va_list ap;
+  int len;
+
+  if (c->used >= REPORT_SIZE - 1)
+    return;
+
+  va_start(ap, fmt);
+  len = vsnprintf(c->report + c->used, REPORT_SIZE - c->used, fmt, ap);
+  va_end(ap);
+
+  if (len > 0)
+    c->used += len;
+  if (c->used >= REPORT_SIZE)
+    c->used = REPORT_SIZE - 1;
+}
+
+static void report_candidate(struct card *c, const char *name, uint32_t size,
+                             imgresult_t res, const bootinfo_t *bi) {
+  if (res == IMG_OK) {
+    report(c, "  chosen:   %-13s %8lu bytes, version %u, CRC %04x\r\n",
+           name, (unsigned long)size, bi->version, bi->crc);
+    c->chosen = 1;
+  } else if (res == IMG_READ || res == IMG_CRC || res == IMG_LENGTH) {
+    report(c, "  rejected: %-13s %8lu bytes, %s\r\n",
+           name, (unsigned long)size, reasons[res]);
+  } else {
+    report(c, "  rejected: %-13s %8lu bytes, version %u: %s\r\n",
+           name, (unsigned long)size, bi->version, reasons[res]);
+  }
+}
+
+static imgresult_t audit_accept(img_select_t *s) {
+  return img_accept(s->bi, flash_version, flash_crc, 0);
+}
+
+/* report each checked file of a search */
+static void audit_result(img_select_t *s, imgresult_t res) {
+  struct card *c    = s->ctx;
+  FILINFO     *fi   = s->fi;
+  uint32_t     size = fi->fsize - s->offset;
+
+  if (res == IMG_OK) {
+    if (s->found)
+      report(c, "  skipped:  %-13s %8lu bytes, version %u: ranks below %s\r\n",
+             s->best.fname, (unsigned long)(s->best.fsize - s->best_offset),
+             s->best_bi.version, fi->fname);
+  } else if (res == IMG_BELOW) {
+    report(c, "  skipped:  %-13s %8lu bytes, version %u: ranks below %s\r\n",
+           fi->fname, (unsigned long)size, s->bi->version, s->best.fname);
+  } else if (res == IMG_DEVICE && s->offset == 0 &&
+             s->bundles && img_bundle_candidate(s->length, fi->fsize)) {
+    report(c, "  rejected: %-13s %8lu bytes, no image for this device in the bundle\r\n",
+           fi->fname, (unsigned long)fi->fsize);
+  } else {
+    report_candidate(c, (char *)fi->fname, size, res, s->bi);
+  }
+}
+
+/* search a card with the settings of the simulated boot loader */
+static void audit_card(struct card *c, uint8_t slot) {
+  FATFS        fat;
+  DIR          dh;
+  FILINFO      finfo;
+  FIL          fd;
+  uint8_t      databuffer[512];
+  bootinfo_t   bi;
+  img_select_t sel;
+  FRESULT      fr;
+
+  c->chosen = 0;
+  if (hostcard_open(&c->disk, c->name)) {
+    report(c, "  unable to read card\r\n");
+    c->unreadable = 1;
+    return;
+  }
+
+  hostdisk_select(slot, &c->disk);
+
+  memset(&sel, 0, sizeof(sel));
+  sel.fs          = &fat;
+  sel.dir         = &dh;
+  sel.fi          = &finfo;
+  sel.fp          = &fd;
+  sel.buf         = databuffer;
+  sel.bi          = &bi;
+  sel.devid       = devid;
+  sel.length      = length;
+  sel.varlen      = varlen;
+  sel.single_pass = single_pass;
+  sel.bundles     = bundles;
+  sel.accept      = audit_accept;
+  sel.result      = audit_result;
+  sel.ctx         = c;
+
+  fr = f_mount(raw_partition ? MOUNT_RAW : 0, &fat);
+  if (fr == FR_OK && fat.fs_type == FS_RAW) {
+    /* like raw_update in main.c */
+    imgresult_t res = img_check_raw(&sel);
+
+    report_candidate(c, "raw partition", finfo.fsize, res, &bi);
+    if (res == IMG_SAME || res == IMG_OLDER)
+      report(c, "  no update\r\n");
+    if (res == IMG_OK || res == IMG_SAME || res == IMG_OLDER)
+      goto done;
+
+    /* fall back to the FAT file system */
+    fr = f_mount(0, &fat);
+  }
+
+  if (fr != FR_OK) {
+    report(c, "  no FAT file system found\r\n");
+    goto done;
+  }
+
+  img_select(&sel);
+
+  if (sel.found)
+    report_candidate(c, (char *)sel.best.fname, sel.best.fsize - sel.best_offset,
+                     IMG_OK, &sel.best_bi);
+  else
+    report(c, "  no update\r\n");
+
+ done:
+  report(c, "  %lu sectors read\r\n", c->disk.reads);
+  hostcard_close(&c->disk);
+}
+
+#ifndef _WIN32
+static pthread_mutex_t card_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *audit_worker(void *arg) {
+  uint8_t slot = (uintptr_t)arg;
+
+  while (1) {
+    unsigned int i;
+
+    pthread_mutex_lock(&card_lock);
+    i = next_card++;
+    pthread_mutex_unlock(&card_lock);
+
+    if (i >= card_count)
+      return NULL;
+
+    audit_card(&cards[i], slot);
+  }
+}
+#endif
+
+static void run_audit(unsigned int threads) {
+#ifdef _WIN32
+  /* no pthreads, check the cards one after another */
+  (void)threads;
+  for (next_card = 0; next_card < card_count; next_card++)
+    audit_card(&cards[next_card], 0);
+#else
+  pthread_t    tids[MAX_THREADS];
+  unsigned int i, started = 0;
+
+  if (threads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? n : 1;
+  }
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+  if (threads > card_count)
+    threads = card_count;
+
+  /* the slot of a thread is the card type ff.c passes to disk_read */
+  for (i=0; i<threads; i++) {
+    if (pthread_create(&tids[i], NULL, audit_worker, (void *)(uintptr_t)i)) {
+      perror("pthread_create");
+      break;
+    }
+    started++;
+  }
+
+  /* finish the remaining cards here if no thread could be started */
+  if (started == 0)
+    audit_worker((void *)0);
+
+  for (i=0; i<started; i++)
+    pthread_join(tids[i], NULL);
+#endif
+}
+
+/* read the tag of the application in flash from an image of it */
+static int read_flash(const char *name) {
+  FILE   *f;
+  uint8_t tag[sizeof(bootinfo_t)];
+
+  f = fopen(name, "rb");
+  if (f == 0) {
+    printf("Unable to open file %s\r\n", name);
+    return 1;
+  }
+
+  if (fseek(f, length - sizeof(tag), SEEK_SET) ||
+      fread(tag, sizeof(tag), 1, f) != 1) {
+    printf("%s is shorter than the application area\r\n", name);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+
+  /* bootinfo_t is little endian */
+  flash_version = tag[4] | (tag[5] << 8);
+  flash_crc     = tag[6] | (tag[7] << 8);
+  return 0;
+}
+
+/* parse a number with range check */
+static int parse_number(const char *str, unsigned long max, unsigned long *value) {
+  unsigned long long v;
+  char *end;
+
+  errno = 0;
+  v = strtoull(str, &end, 0);
+  if (errno || end == str || *end || *str == '-' || v > max) {
+    printf("Invalid number %s (maximum 0x%lx)\r\n", str, max);
+    return 1;
+  }
+
+  *value = v;
+  return 0;
+}
+
+static void usage(void) {
+  printf("Usage: cardaudit [-v] [-s] [-r] [-b] [-f <flash image>] [-t <threads>]\r\n"
+         "                 <length> <signature> <card>...\r\n"
+         "  -v  boot loader built with CONFIG_VARIABLE_LENGTH\r\n"
+         "  -s  boot loader built with CONFIG_SINGLE_PASS_UPDATE\r\n"
+         "  -r  boot loader built with CONFIG_RAW_PARTITION\r\n"
+         "  -b  boot loader built with CONFIG_BUNDLE\r\n"
+         "  -f  tagged image of the application in flash, default empty\r\n"
+         "  -t  number of threads, default one per processor\r\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char   *flashname = NULL;
+  unsigned long threads = 0;
+  unsigned int  i, updates = 0, failed = 0;
+
+  argc--;
+  argv++;
+  while (argc > 0 && argv[0][0] == '-') {
+    if (!strcmp(argv[0], "-v")) {
+      varlen = 1;
+    } else if (!strcmp(argv[0], "-s")) {
+      single_pass = 1;
+    } else if (!strcmp(argv[0], "-r")) {
+      raw_partition = 1;
+    } else if (!strcmp(argv[0], "-b")) {
+      bundles = 1;
+    } else if (!strcmp(argv[0], "-f") && argc > 1) {
+      argc--;
+      argv++;
+      flashname = argv[0];
+    } else if (!strcmp(argv[0], "-t") && argc > 1) {
+      argc--;
+      argv++;
+      if (parse_number(argv[0], MAX_THREADS, &threads))
+        return 1;
+    } else {
+      usage();
+      return 1;
+    }
+    argc--;
+    argv++;
+  }
+
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+
+  if (parse_number(argv[0], MAX_LENGTH, &length) ||
+      parse_number(argv[1], 0xffffffffUL, &devid))
+    return 1;
+
+  if (length < 512 || length % 512) {
+    printf("The length must be a multiple of 512\r\n");
+    return 1;
+  }
+
+  if (flashname && read_flash(flashname))
+    return 1;
+
+  card_count = argc - 2;
+  cards = calloc(card_count, sizeof(struct card));
+  if (!cards) {
+    perror("calloc");
+    return 1;
+  }
+  for (i=0; i<card_count; i++)
+    cards[i].name = argv[i+2];
+
+  run_audit(threads);
+
+  for (i=0; i<card_count; i++) {
+    printf("%s:\r\n%s", cards[i].name, cards[i].report);
+    if (cards[i].chosen)
+      updates++;
+    if (cards[i].unreadable)
+      failed++;
+  }
+
+  printf("%u cards, %u with an update", card_count, updates);
+  if (failed)
+    printf(", %u unreadable", failed);
+  printf("\r\n");
+
+  free(cards);
+  return failed != 0;
+}
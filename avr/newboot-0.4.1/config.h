@@ -36,6 +36,7 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <util/delay.h>
 #include "autoconf.h"
 
 #if CONFIG_HARDWARE_VARIANT==1
@@ -89,6 +90,73 @@ static inline __attribute__((always_inline)) void set_red_led(uint8_t state) {
 }
 
 
+/*** SD card detect ***/
+/* If the card socket has a card detect switch on a pin change      */
+/* interrupt capable pin, define HAVE_SD_DETECT and the functions   */
+/* below. The boot loader then ignores the card interface if no     */
+/* card is inserted and sleeps until one is inserted if there is no */
+/* valid application. Leave it undefined if there is no switch.     */
+/* #  define HAVE_SD_DETECT */
+
+#ifdef HAVE_SD_DETECT
+/* Set up the card detect pin and select it in its PCMSK register */
+static inline void sdcard_interface_init(void) {
+  DDRD   &= ~_BV(PD2);
+  PORTD  |=  _BV(PD2);
+  PCMSK3 |=  _BV(PCINT26);
+}
+
+/* Restore the reset state before starting the application */
+static inline void sdcard_interface_deinit(void) {
+  PCMSK3 &= ~_BV(PCINT26);
+  PORTD  &= ~_BV(PD2);
+}
+
+/* Returns non-zero if a card is inserted */
+static inline uint8_t sdcard_detect(void) {
+  return !(PIND & _BV(PD2));
+}
+
+/* Interrupt vector of the detect pin. The boot loader installs an  */
+/* empty handler for it and moves the interrupt vectors into the    */
+/* boot section only while it sleeps, because a pin change can only */
+/* wake the chip with interrupts enabled globally.                  */
+#  define SDCARD_CHANGE_VECT PCINT3_vect
+
+/* Enable or disable the pin change interrupt of the detect pin */
+static inline void sdcard_change_irq(uint8_t state) {
+  if (state) {
+    PCIFR  = _BV(PCIF3);
+    PCICR |= _BV(PCIE3);
+  } else {
+    PCICR &= ~_BV(PCIE3);
+  }
+}
+#endif
+
+
+/*** Update button ***/
+/* With CONFIG_UPDATE_GATE the card is only searched if this button */
+/* is held during reset, if the application requested it or if the  */
+/* application is corrupt. Define HAVE_UPDATE_BUTTON if the board   */
+/* has a button that can be used for this.                          */
+/* #  define HAVE_UPDATE_BUTTON */
+
+#ifdef HAVE_UPDATE_BUTTON
+/* Returns non-zero if the button is pressed, pins must be left */
+/* in their reset state.                                        */
+static inline uint8_t update_button_pressed(void) {
+  uint8_t state;
+
+  PORTD |= _BV(PD3);
+  _delay_us(10);
+  state = !(PIND & _BV(PD3));
+  PORTD &= ~_BV(PD3);
+  return state;
+}
+#endif
+
+
 /*** Bootloader info ***/
 /* Default bootloader device ID if CONFIG_BOOT_DEVID is not set */
 #define BOOTLOADER_DEVID 0xdeadbeef
@@ -144,7 +212,8 @@ static inline __attribute__((always_inline)) void set_red_led(uint8_t state) {
 
 #if defined __AVR_ATmega644__  \
  || defined __AVR_ATmega644P__  \
- || defined __AVR_ATmega1284P__
+ || defined __AVR_ATmega1284P__ \
+ || defined __AVR_ATmega32__
 
 #  define SPI_PORT   PORTB
 #  define SPI_DDR    DDRB
@@ -168,4 +237,12 @@ static inline __attribute__((always_inline)) void set_red_led(uint8_t state) {
 
 #define SPI_MASK (SPI_SS | SPI_MOSI | SPI_MISO | SPI_SCK)
 
+/* ATmega32 and ATmega128 use the older register names */
+#if !defined TIFR1 && defined TIFR
+#  define TIFR1 TIFR
+#endif
+#if !defined MCUSR && defined MCUCSR
+#  define MCUSR MCUCSR
+#endif
+
 #endif
@@ -27,6 +27,7 @@
    OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
    SUCH DAMAGE.
 
+
 */
 
 #include <stdio.h>
@@ -35,12 +36,33 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <pthread.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#endif
 
 #define lo8(x) (x & 0xFF)
 #define hi8(x) ((x >> 8) & 0xFF)
 #define xhi8(x) ((x >> 16) & 0xff)
 #define xxhi8(x) ((x >> 24) & 0xff)
 
+/* largest supported image */
+#define MAX_LENGTH 0x1000000UL
+
+/* one image to tag */
+struct job {
+  char          *filename;
+  char          *output;
+  unsigned long  length;
+  unsigned long  devid;
+  unsigned long  version;
+  int            variable;
+};
+
 unsigned short crc_ccitt_update (uint16_t crc, uint8_t data)
 {
   data ^= lo8 (crc);
@@ -48,71 +70,911 @@ unsigned short crc_ccitt_update (uint16_t crc, uint8_t data)
   return ((((uint16_t)data << 8) | hi8 (crc)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
 }	
 
-int main(int argc, char *argv[]) {
-  if (argc != 5) {
-    printf("Usage: crcgen <filename> <length> <signature> <version>\r\n");
+/* reference implementation, one byte at a time */
+static uint16_t crc_ccitt_bytewise(uint16_t crc, const uint8_t *data, size_t len) {
+  while (len--)
+    crc = crc_ccitt_update(crc, *data++);
+
+  return crc;
+}
+
+/* Slicing-by-8: crc_table[k][i] is the CRC of byte i followed by */
+/* k zero bytes, so eight bytes can be processed with eight table */
+/* lookups that do not depend on each other.                      */
+static uint16_t crc_table[8][256];
+
+static void crc_init_tables(void) {
+  unsigned int i, k;
+
+  for (i=0; i<256; i++)
+    crc_table[0][i] = crc_ccitt_update(0, i);
+
+  for (k=1; k<8; k++)
+    for (i=0; i<256; i++)
+      crc_table[k][i] = (crc_table[k-1][i] >> 8) ^
+                        crc_table[0][crc_table[k-1][i] & 0xff];
+}
+
+static uint16_t crc_ccitt_sliced(uint16_t crc, const uint8_t *data, size_t len) {
+  while (len >= 8) {
+    crc ^= data[0] | (data[1] << 8);
+    crc = crc_table[7][crc & 0xff] ^ crc_table[6][crc >> 8] ^
+          crc_table[5][data[2]]    ^ crc_table[4][data[3]] ^
+          crc_table[3][data[4]]    ^ crc_table[2][data[5]] ^
+          crc_table[1][data[6]]    ^ crc_table[0][data[7]];
+    data += 8;
+    len  -= 8;
+  }
+
+  while (len--)
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xff];
+
+  return crc;
+}
+
+/* ---- Output file ---- */
+
+/* The output is mapped into memory, so tagging a binary in place only */
+/* touches the padding and the tag instead of copying the whole file.  */
+struct output {
+#ifdef _WIN32
+  FILE    *file;
+#else
+  int      fd;
+#endif
+  uint8_t *data;
+  size_t   size;
+};
+
+/* open the output file, returns its current size or -1 on error */
+static long output_open(struct output *o, const char *name, int create) {
+  o->data = NULL;
+#ifdef _WIN32
+  o->file = fopen(name, create ? "wb+" : "rb+");
+  if (o->file == 0 || fseek(o->file, 0, SEEK_END)) {
+    printf("Unable to open file %s\r\n", name);
+    return -1;
+  }
+  return ftell(o->file);
+#else
+  struct stat st;
+
+  o->fd = open(name, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0666);
+  if (o->fd < 0 || fstat(o->fd, &st)) {
+    printf("Unable to open file %s\r\n", name);
+    return -1;
+  }
+  return st.st_size;
+#endif
+}
+
+/* make the first size bytes of the output accessible in o->data */
+static int output_map(struct output *o, size_t size, size_t existing) {
+  o->size = size;
+#ifdef _WIN32
+  o->data = malloc(size);
+  if (!o->data) {
+    perror("malloc");
+    return 1;
+  }
+  if (existing) {
+    fseek(o->file, 0, SEEK_SET);
+    if (fread(o->data, 1, existing, o->file) != existing) {
+      perror("fread");
+      return 1;
+    }
+  }
+#else
+  if (ftruncate(o->fd, size)) {
+    perror("ftruncate");
+    return 1;
+  }
+  o->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, o->fd, 0);
+  if (o->data == MAP_FAILED) {
+    o->data = NULL;
+    perror("mmap");
     return 1;
   }
+#endif
+  return 0;
+}
 
-  unsigned long length  = strtol(argv[2],NULL,0);
-  unsigned long devid   = strtol(argv[3],NULL,0);
-  unsigned long version = strtol(argv[4],NULL,0);
+/* write back and close the output, cutting it to size bytes */
+static int output_close(struct output *o, size_t size) {
+  int res = 0;
 
-  //printf("len=%ld id=%08lx ver=%ld\n",length,devid,version);
+#ifdef _WIN32
+  if (o->data) {
+    fseek(o->file, 0, SEEK_SET);
+    if (fwrite(o->data, size, 1, o->file) != 1) {
+      perror("fwrite");
+      res = 1;
+    }
+    free(o->data);
+  }
+  if (o->file)
+    fclose(o->file);
+#else
+  if (o->data) {
+    if (msync(o->data, o->size, MS_SYNC)) {
+      perror("msync");
+      res = 1;
+    }
+    munmap(o->data, o->size);
+    if (ftruncate(o->fd, size)) {
+      perror("ftruncate");
+      res = 1;
+    }
+  }
+  if (o->fd >= 0)
+    close(o->fd);
+#endif
 
-  if (length > length+8) {
-    printf("Ha ha, very funny.\n");
+  return res;
+}
+
+
+/* ---- Input formats ---- */
+
+/* AVR ELF files use addresses above this for RAM, EEPROM and fuses */
+#define ELF_FLASH_END 0x800000UL
+
+static uint32_t get_le(const uint8_t *p, int bytes) {
+  uint32_t v = 0;
+
+  while (bytes--)
+    v = (v << 8) | p[bytes];
+
+  return v;
+}
+
+/* read a complete file into memory */
+static uint8_t *read_file(FILE *f, size_t *size) {
+  uint8_t *buf;
+  long     len;
+
+  if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+    return NULL;
+
+  buf = malloc(len ? len : 1);
+  if (buf && fread(buf, 1, len, f) != (size_t)len) {
+    free(buf);
+    return NULL;
+  }
+
+  *size = len;
+  return buf;
+}
+
+/* copy the flash contents of an ELF file into image */
+static int load_elf(const char *name, FILE *f, uint8_t *image,
+                    unsigned long length, unsigned long *used) {
+  size_t   size;
+  uint8_t *elf = read_file(f, &size);
+  uint32_t phoff, phentsize, phnum, i;
+
+  if (!elf) {
+    printf("%s: Unable to read file\r\n", name);
     return 1;
   }
 
-  uint8_t *data = malloc(length+8);
+  /* 32 bit little-endian only, this is for AVR after all */
+  if (size < 52 || elf[4] != 1 || elf[5] != 1) {
+    printf("%s: Unsupported ELF file\r\n", name);
+    free(elf);
+    return 1;
+  }
 
-  if (!data) {
-    perror("malloc");
+  phoff     = get_le(elf + 28, 4);
+  phentsize = get_le(elf + 42, 2);
+  phnum     = get_le(elf + 44, 2);
+
+  if (phentsize < 32 || phoff > size || phnum > (size - phoff) / phentsize) {
+    printf("%s: Invalid program header table\r\n", name);
+    free(elf);
     return 1;
   }
 
-  memset(data, 0xff, length);
-  
-  FILE *f;
-  
-  f = fopen(argv[1], "rb+");
-  
-  if (f == 0) {
-    printf("Unable to open file %s\r\n", argv[1]);
+  for (i=0; i<phnum; i++) {
+    const uint8_t *ph = elf + phoff + i * phentsize;
+    uint32_t offset = get_le(ph +  4, 4);
+    uint32_t paddr  = get_le(ph + 12, 4);
+    uint32_t filesz = get_le(ph + 16, 4);
+
+    /* PT_LOAD segments with contents that end up in the flash */
+    if (get_le(ph, 4) != 1 || filesz == 0 || paddr >= ELF_FLASH_END)
+      continue;
+
+    if (offset > size || filesz > size - offset) {
+      printf("%s: Segment outside of file\r\n", name);
+      free(elf);
+      return 1;
+    }
+
+    if (paddr > length || filesz > length - paddr) {
+      printf("%s: Segment at 0x%lx does not fit into the image\r\n",
+             name, (unsigned long)paddr);
+      free(elf);
+      return 1;
+    }
+
+    memcpy(image + paddr, elf + offset, filesz);
+    if (paddr + filesz > *used)
+      *used = paddr + filesz;
+  }
+
+  free(elf);
+  return 0;
+}
+
+/* copy the contents of an Intel HEX file into image */
+static int load_hex(const char *name, FILE *f, uint8_t *image,
+                    unsigned long length, unsigned long *used) {
+  char     line[600];
+  uint8_t  rec[256+5];
+  uint32_t base = 0;
+  unsigned int lineno = 0;
+
+  fseek(f, 0, SEEK_SET);
+  while (fgets(line, sizeof(line), f)) {
+    unsigned int i, count, byte;
+    uint8_t  sum = 0;
+    uint32_t addr;
+
+    lineno++;
+    if (line[0] != ':')
+      continue;
+
+    /* convert the record to binary and check its checksum */
+    for (count = 0; count < sizeof(rec); count++) {
+      if (sscanf(line + 1 + 2*count, "%2x", &byte) != 1)
+        break;
+      rec[count] = byte;
+      sum += byte;
+    }
+
+    if (count < 5 || count != rec[0] + 5u || sum != 0) {
+      printf("%s:%u: Invalid record\r\n", name, lineno);
+      return 1;
+    }
+
+    addr = base + ((rec[1] << 8) | rec[2]);
+
+    switch (rec[3]) {
+    case 0: /* data */
+      if (addr > length || rec[0] > length - addr) {
+        printf("%s:%u: Data at 0x%lx does not fit into the image\r\n",
+               name, lineno, (unsigned long)addr);
+        return 1;
+      }
+      for (i=0; i<rec[0]; i++)
+        image[addr + i] = rec[4 + i];
+      if (addr + rec[0] > *used)
+        *used = addr + rec[0];
+      break;
+
+    case 1: /* end of file */
+      return 0;
+
+    case 2: /* extended segment address */
+      base = ((rec[4] << 8) | rec[5]) << 4;
+      break;
+
+    case 4: /* extended linear address */
+      base = (uint32_t)((rec[4] << 8) | rec[5]) << 16;
+      break;
+
+    default: /* start addresses */
+      break;
+    }
+  }
+
+  return 0;
+}
+
+
+/* tag a single image, returns 0 on success */
+static int tag_image(const struct job *j) {
+  unsigned long length = j->length;
+  unsigned long used = 0;
+  const char   *outname = j->output ? j->output : j->filename;
+  struct output out;
+  uint8_t magic[4] = { 0 };
+  long    existing;
+  int     res = 1;
+  FILE   *f = NULL;
+
+  if (length < 12 || (j->variable && length % 512)) {
+    printf("Ha ha, very funny.\n");
     return 1;
   }
-  
-  fread(data, 1, length, f);
 
-  data[length-8] = lo8(devid);
-  data[length-7] = hi8(devid);
-  data[length-6] = xhi8(devid);
-  data[length-5] = xxhi8(devid);
-  data[length-4] = lo8(version);
-  data[length-3] = hi8(version);
+  /* check the format of the input */
+  if (j->output) {
+    f = fopen(j->filename, "rb");
+    if (f == 0) {
+      printf("Unable to open file %s\r\n", j->filename);
+      return 1;
+    }
+    if (fread(magic, 1, sizeof(magic), f) < 1)
+      magic[0] = 0;
+  }
 
-  unsigned long l;
-  unsigned short crc = 0xFFFF;
-  
-  for (l=0; l < length-2; l++)
-    crc = crc_ccitt_update(crc, data[l]);
+  existing = output_open(&out, outname, j->output != NULL);
+  if (existing < 0)
+    goto fail;
+
+  if (j->output) {
+    /* build the image in the output file */
+    if (output_map(&out, length, 0))
+      goto fail;
+    memset(out.data, 0xff, length);
+
+    if (!memcmp(magic, "\x7f" "ELF", 4)) {
+      if (load_elf(j->filename, f, out.data, length, &used))
+        goto fail;
+    } else if (magic[0] == ':') {
+      if (load_hex(j->filename, f, out.data, length, &used))
+        goto fail;
+    } else {
+      fseek(f, 0, SEEK_SET);
+      used = fread(out.data, 1, length, f);
+      if (fgetc(f) != EOF) {
+        printf("%s: Binary larger than the image\r\n", j->filename);
+        goto fail;
+      }
+    }
+  } else {
+    /* tag a binary in place */
+    if ((unsigned long)existing > length) {
+      printf("%s: Binary larger than the image\r\n", j->filename);
+      goto fail;
+    }
+    if (output_map(&out, length, existing))
+      goto fail;
+    used = existing;
+    memset(out.data + used, 0xff, length - used);
+  }
+
+  if (j->variable) {
+    /* The file is written as the sectors used by the application,  */
+    /* followed by a tag sector that ends up in the last sector of  */
+    /* the full image. The number of application sectors is stored  */
+    /* in front of the tag together with its complement. The tag    */
+    /* sector is empty apart from the tag unless the application    */
+    /* reaches into the last sector, so nothing needs to be moved.  */
+    unsigned long sectors = (used + 511) / 512;
+
+    if (used > length-12) {
+      printf("%s: Binary too large for a variable-length image\r\n", j->filename);
+      goto fail;
+    }
+
+    if (sectors > length/512 - 1)
+      sectors = length/512 - 1;
+
+    length = (sectors+1) * 512;
+
+    out.data[length-12] = lo8(sectors);
+    out.data[length-11] = hi8(sectors);
+    out.data[length-10] = lo8(~sectors);
+    out.data[length-9]  = hi8(~sectors);
+  }
+
+  uint8_t *data = out.data;
+
+  data[length-8] = lo8(j->devid);
+  data[length-7] = hi8(j->devid);
+  data[length-6] = xhi8(j->devid);
+  data[length-5] = xxhi8(j->devid);
+  data[length-4] = lo8(j->version);
+  data[length-3] = hi8(j->version);
+
+  unsigned short crc = crc_ccitt_sliced(0xFFFF, data, length-2);
   
   data[length-2] = lo8(crc);
   data[length-1] = hi8(crc);
 
-  if (fseek(f, 0, SEEK_SET)) {
-    perror("fseek");
+  res = 0;
+
+ fail:
+  /* on errors the output is cut back to its original size */
+  if (existing >= 0 && output_close(&out, res ? (size_t)existing : length))
+    res = 1;
+  if (f)
+    fclose(f);
+
+  /* a separate output file would be empty or half-built, */
+  /* don't leave it around for a later build step         */
+  if (res && j->output && existing >= 0)
+    remove(outname);
+
+  return res;
+}
+
+/* parse a number with range check */
+static int parse_number(const char *str, unsigned long max, unsigned long *value) {
+  unsigned long long v;
+  char *end;
+
+  errno = 0;
+  v = strtoull(str, &end, 0);
+  if (errno || end == str || *end || *str == '-' || v > max) {
+    printf("Invalid number %s (maximum 0x%lx)\r\n", str, max);
     return 1;
   }
 
-  if (fwrite(data, length, 1, f) != 1) {
-    perror("fwrite");
+  *value = v;
+  return 0;
+}
+
+/* parse "[-v] [-o <output>] <filename> <length> <signature> <version>" */
+static int parse_job(struct job *j, int argc, char *argv[]) {
+  j->variable = 0;
+  j->output   = NULL;
+
+  while (argc > 0 && argv[0][0] == '-') {
+    if (!strcmp(argv[0], "-v")) {
+      /* write a variable-length image */
+      j->variable = 1;
+    } else if (!strcmp(argv[0], "-o") && argc > 1) {
+      /* write to a separate file, required for ELF and HEX input */
+      argc--;
+      argv++;
+      j->output = argv[0];
+    } else {
+      return 1;
+    }
+    argc--;
+    argv++;
+  }
+
+  if (argc != 4)
     return 1;
+
+  j->filename = argv[0];
+  if (parse_number(argv[1], MAX_LENGTH, &j->length) ||
+      parse_number(argv[2], 0xffffffffUL, &j->devid) ||
+      parse_number(argv[3], 0xffff, &j->version))
+    return 1;
+
+  return 0;
+}
+
+
+/* ---- Batch mode ---- */
+
+static struct job *jobs;
+static unsigned int job_count, next_job, failed_jobs;
+
+#ifndef _WIN32
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *batch_worker(void *arg) {
+  while (1) {
+    unsigned int i;
+
+    pthread_mutex_lock(&job_lock);
+    i = next_job++;
+    pthread_mutex_unlock(&job_lock);
+
+    if (i >= job_count)
+      return NULL;
+
+    if (tag_image(&jobs[i])) {
+      pthread_mutex_lock(&job_lock);
+      failed_jobs++;
+      pthread_mutex_unlock(&job_lock);
+    }
   }
-  
+}
+#endif
+
+/* read a manifest with one job per line in the same format as the */
+/* command line, empty lines and lines starting with # are ignored */
+static int read_manifest(const char *name) {
+  FILE *f;
+  char  line[1024];
+  unsigned int lineno = 0, allocated = 0;
+
+  f = fopen(name, "r");
+  if (f == 0) {
+    printf("Unable to open file %s\r\n", name);
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    char *args[8];
+    int   count = 0;
+    char *tok;
+
+    lineno++;
+    for (tok = strtok(line, " \t\r\n"); tok && count < 8; tok = strtok(NULL, " \t\r\n"))
+      args[count++] = tok;
+
+    if (count == 0 || args[0][0] == '#')
+      continue;
+
+    if (job_count == allocated) {
+      allocated = allocated ? 2*allocated : 64;
+      jobs = realloc(jobs, allocated * sizeof(struct job));
+      if (!jobs) {
+        perror("realloc");
+        return 1;
+      }
+    }
+
+    if (parse_job(&jobs[job_count], count, args)) {
+      printf("%s:%u: Invalid job\r\n", name, lineno);
+      return 1;
+    }
+
+    jobs[job_count].filename = strdup(jobs[job_count].filename);
+    if (jobs[job_count].output)
+      jobs[job_count].output = strdup(jobs[job_count].output);
+    if (!jobs[job_count].filename) {
+      perror("strdup");
+      return 1;
+    }
+    job_count++;
+  }
+
   fclose(f);
-  
   return 0;
 }
 
+static int run_batch(const char *manifest, unsigned int threads) {
+  if (read_manifest(manifest))
+    return 1;
+
+#ifdef _WIN32
+  /* no pthreads, tag the images one after another */
+  (void)threads;
+  for (next_job = 0; next_job < job_count; next_job++)
+    if (tag_image(&jobs[next_job]))
+      failed_jobs++;
+#else
+  pthread_t   *tids;
+  unsigned int i;
+
+  if (threads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? n : 1;
+  }
+  if (threads > job_count)
+    threads = job_count ? job_count : 1;
+
+  tids = malloc(threads * sizeof(pthread_t));
+  if (!tids) {
+    perror("malloc");
+    return 1;
+  }
+
+  for (i=0; i<threads; i++)
+    if (pthread_create(&tids[i], NULL, batch_worker, NULL)) {
+      perror("pthread_create");
+      return 1;
+    }
+
+  for (i=0; i<threads; i++)
+    pthread_join(tids[i], NULL);
+
+  free(tids);
+#endif
+
+  if (failed_jobs) {
+    printf("%u of %u images failed\r\n", failed_jobs, job_count);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* ---- Delta files ---- */
+
+#define DELTA_HEADER_BYTES 12   /* magic, device ID, base CRC, sectors */
+
+/* read a tagged image and check its CRC */
+static uint8_t *read_image(const char *name, size_t *size) {
+  FILE    *f = fopen(name, "rb");
+  uint8_t *data;
+
+  if (f == 0) {
+    printf("Unable to open file %s\r\n", name);
+    return NULL;
+  }
+
+  data = read_file(f, size);
+  fclose(f);
+  if (!data) {
+    printf("%s: Unable to read file\r\n", name);
+    return NULL;
+  }
+
+  if (*size < 1024 || *size % 512 || crc_ccitt_sliced(0xffff, data, *size) != 0) {
+    printf("%s: Not a full-length tagged image\r\n", name);
+    free(data);
+    return NULL;
+  }
+
+  return data;
+}
+
+/* write the sectors of new that differ from base, see main.c */
+static int make_delta(const char *basename, const char *newname, const char *outname) {
+  uint8_t *base, *new, header[512];
+  size_t   size, newsize, sectors, s, changed = 0;
+  FILE    *f;
+
+  base = read_image(basename, &size);
+  if (!base)
+    return 1;
+  new = read_image(newname, &newsize);
+  if (!new)
+    return 1;
+
+  sectors = size / 512;
+  if (newsize != size || sectors > (sizeof(header) - DELTA_HEADER_BYTES - 2) * 8) {
+    printf("Images must have the same length\r\n");
+    return 1;
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, "NBDP", 4);
+  memcpy(header + 4, new + size - 8, 4);        /* device ID */
+  memcpy(header + 8, base + size - 2, 2);       /* tag CRC of the base */
+  header[10] = lo8(sectors);
+  header[11] = hi8(sectors);
+
+  for (s = 0; s < sectors; s++)
+    if (memcmp(base + 512*s, new + 512*s, 512)) {
+      header[DELTA_HEADER_BYTES + s/8] |= 1 << (s % 8);
+      changed++;
+    }
+
+  /* the boot loader needs the new tag */
+  if (!(header[DELTA_HEADER_BYTES + (sectors-1)/8] & (1 << ((sectors-1) % 8)))) {
+    printf("The tags of both images are identical\r\n");
+    return 1;
+  }
+
+  /* the boot loader only considers files shorter than an image */
+  if ((changed + 1) * 512 >= size) {
+    printf("Delta would not be smaller than the full image\r\n");
+    return 1;
+  }
+
+  unsigned short crc = crc_ccitt_sliced(0xffff, header, 510);
+  header[510] = lo8(crc);
+  header[511] = hi8(crc);
+
+  f = fopen(outname, "wb");
+  if (f == 0) {
+    printf("Unable to open file %s\r\n", outname);
+    return 1;
+  }
+
+  if (fwrite(header, 512, 1, f) != 1) {
+    perror("fwrite");
+    return 1;
+  }
+
+  for (s = 0; s < sectors; s++)
+    if (header[DELTA_HEADER_BYTES + s/8] & (1 << (s % 8)))
+      if (fwrite(new + 512*s, 512, 1, f) != 1) {
+        perror("fwrite");
+        return 1;
+      }
+
+  if (fclose(f)) {
+    perror("fclose");
+    return 1;
+  }
+
+  printf("%lu of %lu sectors changed\r\n", (unsigned long)changed, (unsigned long)sectors);
+  free(base);
+  free(new);
+  return 0;
+}
+
+
+/* ---- Bundles ---- */
+
+#define BUNDLE_ENTRIES     31   /* see imagecheck.h */
+#define BUNDLE_ENTRY_BYTES 16   /* device ID, version, CRC, offset, length */
+
+static void put32(uint8_t *p, unsigned long v) {
+  p[0] = lo8(v);
+  p[1] = hi8(v);
+  p[2] = xhi8(v);
+  p[3] = xxhi8(v);
+}
+
+/* write an index sector and the images behind it, see imagecheck.h */
+static int make_bundle(unsigned long length, const char *outname,
+                       int count, char *names[]) {
+  uint8_t *images[BUNDLE_ENTRIES], index[512];
+  size_t   sizes[BUNDLE_ENTRIES];
+  unsigned long offset = 512;
+  int      i, k;
+  FILE    *f;
+
+  if (count > BUNDLE_ENTRIES) {
+    printf("A bundle holds at most %d images\r\n", BUNDLE_ENTRIES);
+    return 1;
+  }
+
+  memset(index, 0, sizeof(index));
+  memcpy(index, "NBBX", 4);
+  index[4] = count;
+
+  for (i = 0; i < count; i++) {
+    uint8_t *entry = index + 8 + i * BUNDLE_ENTRY_BYTES;
+
+    images[i] = read_image(names[i], &sizes[i]);
+    if (!images[i])
+      return 1;
+
+    if (sizes[i] > length) {
+      printf("%s: Image larger than the application area\r\n", names[i]);
+      return 1;
+    }
+
+    /* device ID, version and CRC are copied from the tag */
+    memcpy(entry, images[i] + sizes[i] - 8, 8);
+    for (k = 0; k < i; k++)
+      if (!memcmp(entry, index + 8 + k * BUNDLE_ENTRY_BYTES, 4)) {
+        printf("%s: Device ID already used by %s\r\n", names[i], names[k]);
+        return 1;
+      }
+
+    put32(entry + 8, offset);
+    put32(entry + 12, sizes[i]);
+    offset += sizes[i];
+  }
+
+  unsigned short crc = crc_ccitt_sliced(0xffff, index, 510);
+  index[510] = lo8(crc);
+  index[511] = hi8(crc);
+
+  f = fopen(outname, "wb");
+  if (f == 0) {
+    printf("Unable to open file %s\r\n", outname);
+    return 1;
+  }
+
+  if (fwrite(index, 512, 1, f) != 1) {
+    perror("fwrite");
+    return 1;
+  }
+
+  for (i = 0; i < count; i++)
+    if (fwrite(images[i], sizes[i], 1, f) != 1) {
+      perror("fwrite");
+      return 1;
+    }
+
+  /* the boot loader only looks for bundles in files that */
+  /* are larger than the application area                 */
+  memset(index, 0xff, sizeof(index));
+  for (; offset <= length; offset += 512)
+    if (fwrite(index, 512, 1, f) != 1) {
+      perror("fwrite");
+      return 1;
+    }
+
+  if (fclose(f)) {
+    perror("fclose");
+    return 1;
+  }
+
+  printf("%d images, %lu bytes\r\n", count, offset);
+  for (i = 0; i < count; i++)
+    free(images[i]);
+  return 0;
+}
+
+
+/* ---- Benchmark ---- */
+
+static double seconds(void) {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static int benchmark(unsigned long size) {
+  uint8_t *data = malloc(size);
+  unsigned long i;
+  uint16_t crc1, crc2;
+  double t0, t1, t2;
+
+  if (!data) {
+    perror("malloc");
+    return 1;
+  }
+
+  srand(1);
+  for (i=0; i<size; i++)
+    data[i] = rand();
+
+  t0   = seconds();
+  crc1 = crc_ccitt_bytewise(0xffff, data, size);
+  t1   = seconds();
+  crc2 = crc_ccitt_sliced(0xffff, data, size);
+  t2   = seconds();
+
+  printf("bytewise:   %8.1f MB/s  crc %04x\r\n", size / 1e6 / (t1-t0 > 0 ? t1-t0 : 1e-9), crc1);
+  printf("slicing-8:  %8.1f MB/s  crc %04x\r\n", size / 1e6 / (t2-t1 > 0 ? t2-t1 : 1e-9), crc2);
+
+  free(data);
+
+  if (crc1 != crc2) {
+    printf("CRC mismatch!\r\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+static void usage(void) {
+  printf("Usage: crcgen [-v] [-o <output>] <filename> <length> <signature> <version>\r\n"
+         "       crcgen -j <manifest> [threads]\r\n"
+         "       crcgen -d <base image> <new image> <delta file>\r\n"
+         "       crcgen -B <length> <bundle> <image>...\r\n"
+         "       crcgen -b [bytes]\r\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct job j;
+
+  crc_init_tables();
+
+  if (argc >= 2 && !strcmp(argv[1], "-j")) {
+    if (argc < 3 || argc > 4) {
+      usage();
+      return 1;
+    }
+    unsigned long threads = 0;
+
+    if (argc == 4 && parse_number(argv[3], 1024, &threads))
+      return 1;
+    return run_batch(argv[2], threads);
+  }
+
+  if (argc >= 2 && !strcmp(argv[1], "-d")) {
+    if (argc != 5) {
+      usage();
+      return 1;
+    }
+    return make_delta(argv[2], argv[3], argv[4]);
+  }
+
+  if (argc >= 2 && !strcmp(argv[1], "-B")) {
+    unsigned long length;
+
+    if (argc < 5) {
+      usage();
+      return 1;
+    }
+    if (parse_number(argv[2], MAX_LENGTH, &length))
+      return 1;
+    return make_bundle(length, argv[3], argc - 4, argv + 4);
+  }
+
+  if (argc >= 2 && !strcmp(argv[1], "-b")) {
+    unsigned long size = 64*1024*1024;
+
+    if (argc >= 3 && parse_number(argv[2], 0x40000000UL, &size))
+      return 1;
+    return benchmark(size);
+  }
+
+  if (parse_job(&j, argc-1, argv+1)) {
+    usage();
+    return 1;
+  }
+
+  //printf("len=%ld id=%08lx ver=%ld\n",j.length,j.devid,j.version);
+
+  return tag_image(&j);
+}
@@ -27,10 +27,16 @@ typedef enum {
 /* Prototypes for disk control functions */
 
 int assign_drives (int, int);
-DSTATUS disk_initialize (void);
+DSTATUS disk_initialize (BYTE*);
+DSTATUS disk_initialize_poll (BYTE*, void (*)(void));
+DSTATUS disk_resume (BYTE);
+struct card_probe;
+DSTATUS disk_probe (BYTE*, struct card_probe*);
+extern struct sd_trace sd_trace;
 //DSTATUS disk_status (void);
 #define disk_status(x) 0
-DRESULT disk_read (BYTE*, DWORD);
+DRESULT disk_read (BYTE, BYTE*, DWORD);
+DRESULT disk_read_crc (BYTE, BYTE*, DWORD, WORD*);
 #if	_READONLY == 0
 DRESULT disk_write (BYTE, const BYTE*, DWORD, BYTE);
 #endif
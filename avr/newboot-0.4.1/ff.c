@@ -56,9 +56,13 @@
 /
 /---------------------------------------------------------------------------*/
 
-#include <avr/pgmspace.h>
 #include <string.h>
-#include "config.h"
+#ifdef HOST_BUILD
+#  include "host.h"
+#else
+#  include <avr/pgmspace.h>
+#  include "config.h"
+#endif
 #include "ff.h"         /* FatFs declarations */
 #include "diskio.h"     /* Include file for user provided disk functions */
 
@@ -83,8 +87,10 @@ BUF static_buf;
 # define FSBUF (fs->buf)
 #endif
 
-#if _USE_FS_BUF != 0
+#if _USE_FS_BUF != 0 && _USE_1_BUF != 0
 # define FPBUF FSBUF
+#elif _USE_FS_BUF != 0
+# define FPBUF (fp->fs->buf)
 #else
 # define FPBUF (fp->buf)
 #endif
@@ -129,7 +135,7 @@ BOOL move_window (      /* TRUE: successful, FALSE: failed */
     }
 #endif
     if (sector) {
-      if (disk_read(buf->data, sector) != RES_OK)
+      if (disk_read(fs->drive, buf->data, sector) != RES_OK)
         return FALSE;
       buf->sect = sector;
 #if _USE_1_BUF != 0
@@ -311,7 +317,8 @@ void get_fileinfo (     /* No return code */
   const BYTE *dir       /* Ptr to the directory entry */
 )
 {
-#if 0
+#ifdef HOST_BUILD
+  /* the host tools report file names */
   BYTE n, c, a;
   UCHAR *p;
 
@@ -334,8 +341,9 @@ void get_fileinfo (     /* No return code */
     }
   }
   *p = '\0';
-#endif
+#else
   finfo->fname[0] = 1;
+#endif
 
   finfo->fsize = LD_DWORD(&dir[DIR_FileSize]);  /* Size */
   finfo->clust = ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16)
@@ -350,7 +358,15 @@ void get_fileinfo (     /* No return code */
 /* Load boot record and check if it is a FAT boot record                 */
 /*-----------------------------------------------------------------------*/
 
-static const /*PROGMEM*/ UCHAR fat32string[] = "FAT32";
+static const PROGMEM UCHAR fat32string[] = "FAT32";
+
+/* The string stays in flash because the service table calls this code
+   without the boot loader's .data. Above 64K it needs a far read. */
+#if BINARY_LENGTH >= 65536
+#  define fat32_compare(ptr, len) memcmp_PF(ptr, pgm_get_far_address(fat32string), len)
+#else
+#  define fat32_compare(ptr, len) memcmp_P(ptr, fat32string, len)
+#endif
 
 static
 BYTE check_fs (     /* 0:The FAT boot record, 1:Valid boot record but not a FAT, 2:Not a boot record or error */
@@ -361,16 +377,16 @@ BYTE check_fs (     /* 0:The FAT boot record, 1:Valid boot record but not a FAT,
   if (!move_fs_window(fs, sect))                    /* Load boot record, save off old data in process */
     return 2;
   if (!sect) {
-    if (disk_read(FSBUF.data, sect) != RES_OK)  /* Load boot record, if sector 0 */
+    if (disk_read(fs->drive, FSBUF.data, sect) != RES_OK)  /* Load boot record, if sector 0 */
       return 2;
     FSBUF.sect = 0;
   }
   if (LD_WORD(&FSBUF.data[BS_55AA]) != 0xAA55)      /* Check record signature (always placed at offset 510 even if the sector size is >512) */
     return 2;
 
-  if (!memcmp(&FSBUF.data[BS_FilSysType], fat32string, 3))        /* Check FAT signature */
+  if (!fat32_compare(&FSBUF.data[BS_FilSysType], 3))        /* Check FAT signature */
     return 0;
-  if (!memcmp(&FSBUF.data[BS_FilSysType32], fat32string, 5) && !(FSBUF.data[BPB_ExtFlags] & 0x80))
+  if (!fat32_compare(&FSBUF.data[BS_FilSysType32], 5) && !(FSBUF.data[BPB_ExtFlags] & 0x80))
     return 0;
 
   return 1;
@@ -393,9 +409,18 @@ FRESULT mount_drv(
   BYTE fmt, *tbl;
   DWORD bootsect, fatsize, totalsect, maxclust;
 
-  memset(fs, 0, sizeof(FATFS));       /* Clean-up the file system object */
-  //fs->drive = LD2PD(drv);             /* Bind the logical drive and a physical drive */
-  stat = disk_initialize();           /* Initialize low level disk I/O layer */
+#if defined(CONFIG_BACKGROUND_CRC) || defined(CONFIG_WARM_START)
+  if (drv & MOUNT_INITIALIZED) {      /* Keep the card type of an initialized card */
+    BYTE type = fs->drive;
+    memset(fs, 0, sizeof(FATFS));
+    fs->drive = type;
+    stat = 0;
+  } else
+#endif
+  {
+    memset(fs, 0, sizeof(FATFS));       /* Clean-up the file system object */
+    stat = disk_initialize(&fs->drive); /* Initialize low level disk I/O layer */
+  }
   if (stat & STA_NOINIT)              /* Check if the drive is ready */
     return FR_NOT_READY;
 #if S_MAX_SIZ > 512                   /* Get disk sector size if needed */
@@ -412,6 +437,22 @@ FRESULT mount_drv(
   if (fmt == 1) {                     /* Not a FAT boot record, it may be patitioned */
     /* Check a partition listed in top of the partition table */
     tbl = &FSBUF.data[MBR_Table + LD2PT(drv) * 16]; /* Partition table */
+#ifdef CONFIG_RAW_PARTITION
+    /* A raw firmware partition in the first entry holds an image file  */
+    /* without a file system. It is presented as a volume that consists */
+    /* of a single cluster 2, the FAT partition is the next entry.      */
+    if (tbl[4] == RAW_PARTITION_TYPE) {
+      totalsect = LD_DWORD(&tbl[12]);
+      if ((drv & MOUNT_RAW) && totalsect && totalsect < 256) {
+        fs->database  = LD_DWORD(&tbl[8]);
+        fs->csize     = totalsect;
+        fs->max_clust = 3;
+        fs->fs_type   = FS_RAW;
+        return FR_OK;
+      }
+      tbl += 16;
+    }
+#endif
     if (tbl[4]) {                     /* Is the partition existing? */
       bootsect = LD_DWORD(&tbl[8]);   /* Partition offset in LBA */
       fmt = check_fs(fs, bootsect);   /* Check the partition */
@@ -425,7 +466,7 @@ FRESULT mount_drv(
   } else {
     /* Read MBR */
     fmt = 1;
-    if (disk_read(FSBUF.data, 0) != RES_OK)
+    if (disk_read(fs->drive, FSBUF.data, 0) != RES_OK)
       goto failed;
 
     if (LD2PT(drv) < 5) {
@@ -461,7 +502,7 @@ FRESULT mount_drv(
           fatsize = bootsect;
 
         /* Read the next sector in the partition chain */
-        if (disk_read(FSBUF.data, bootsect) != RES_OK)
+        if (disk_read(fs->drive, FSBUF.data, bootsect) != RES_OK)
           goto failed;
       } while (--curr);
       /* Look for the non-extended, non-empty partition entry */
@@ -619,6 +660,36 @@ FRESULT l_openfile (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Move to the next sector of a file                                     */
+/*-----------------------------------------------------------------------*/
+
+static
+BOOL next_file_sector ( /* TRUE: successful, FALSE: end of cluster chain */
+  FIL *fp               /* Pointer to the file object */
+)
+{
+  DWORD clust;
+  FATFS *fs = fp->fs;
+
+
+  if (--fp->csect) {                        /* Decrement left sector counter */
+    fp->curr_sect++;                        /* Get current sector */
+  } else {                                  /* On the cluster boundary, get next cluster */
+    clust = (fp->fptr == 0) ?
+      fp->org_clust : get_cluster(fs, fp->curr_clust);
+    if (clust < 2 || clust >= fs->max_clust)
+      return FALSE;
+    fp->curr_clust = clust;                 /* Current cluster */
+    fp->curr_sect = clust2sect(fs, clust);  /* Get current sector */
+    fp->csect = fs->csize;                  /* Re-initialize the left sector counter */
+  }
+  return TRUE;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
@@ -631,8 +702,8 @@ FRESULT f_read (
 )
 {
   FRESULT res;
-  DWORD clust, sect, remain;
-  UINT rcnt, cc;
+  DWORD remain;
+  UINT rcnt;
   BYTE *rbuff = buff;
   FATFS *fs = fp->fs;
 
@@ -648,29 +719,15 @@ FRESULT f_read (
   for ( ;  btr;                                 /* Repeat until all data transferred */
         rbuff += rcnt, fp->fptr += rcnt, /**br += rcnt,*/ btr -= rcnt) {
     if ((fp->fptr & (SS(fs) - 1)) == 0) {       /* On the sector boundary */
-      if (--fp->csect) {                        /* Decrement left sector counter */
-        sect = fp->curr_sect + 1;               /* Get current sector */
-      } else {                                  /* On the cluster boundary, get next cluster */
-        clust = (fp->fptr == 0) ?
-          fp->org_clust : get_cluster(fs, fp->curr_clust);
-        if (clust < 2 || clust >= fs->max_clust)
-          goto fr_error;
-        fp->curr_clust = clust;                 /* Current cluster */
-        sect = clust2sect(fs, clust);           /* Get current sector */
-        fp->csect = fs->csize;                  /* Re-initialize the left sector counter */
-      }
+      if (!next_file_sector(fp))
+        goto fr_error;
 #if !_FS_READONLY
       if(!move_fp_window(fp,0)) goto fr_error;
 #endif
-      fp->curr_sect = sect;           /* Update current sector */
-      //cc = btr / SS(fs);              /* When left bytes >= SS(fs), */
-      if (btr == SS(fs)) {            /* Read maximum contiguous sectors directly */
-        cc = 1;
-        if (disk_read(rbuff, sect) != RES_OK)
+      if (btr == SS(fs)) {            /* Read a full sector directly */
+        if (disk_read(fs->drive, rbuff, fp->curr_sect) != RES_OK)
           goto fr_error;
-        fp->csect -= (BYTE)(cc - 1);
-        fp->curr_sect += cc - 1;
-        rcnt = cc * SS(fs);
+        rcnt = SS(fs);
         continue;
       }
     }
@@ -692,6 +749,35 @@ fr_error: /* Abort this file due to an unrecoverable error */
 
 
 
+/**
+ * l_read_crc - read a sector of a file and update a CRC
+ * @fp : Pointer to the file object, file pointer must be sector-aligned
+ * @buff: Pointer to a buffer for one sector
+ * @crc: Pointer to the CRC to update
+ *
+ * This function reads the next full sector of a file like f_read would,
+ * but calculates the CRC-CCITT of the data while it is transferred.
+ */
+FRESULT l_read_crc (
+  FIL *fp,
+  void *buff,
+  WORD *crc
+)
+{
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR;
+  if (fp->fsize - fp->fptr < SS(fp->fs) ||
+      !next_file_sector(fp) ||
+      disk_read_crc(fp->fs->drive, buff, fp->curr_sect, crc) != RES_OK) {
+    fp->flag |= FA__ERROR;
+    return FR_RW_ERROR;
+  }
+  fp->fptr += SS(fp->fs);
+  return FR_OK;
+}
+
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Write File                                                            */
@@ -93,8 +93,10 @@
 
 /* When set to 1, All objects will use a static  buffer.  This reduces memory
 /  requirements to the absolute minimum ~512 bytes for the buffer, but will
-/  operate slower.  This option can only be set if _USE_FS_BUF is set.  */
-#define _USE_1_BUF 1
+/  operate slower.  This option can only be set if _USE_FS_BUF is set.
+/  newboot keeps this at 0 so all state lives in caller-supplied objects,
+/  which is required for calling the file system from applications.  */
+#define _USE_1_BUF 0
 
 /* If set to 1, FatFs will manage the FATFS structures after mounting.  If
 /  set to 0, the caller must send the correct drive FATFS structure for each
@@ -167,6 +169,7 @@ typedef struct _FATFS {
 #endif
 #endif
     BYTE    fs_type;        /* FAT sub type */
+    BYTE    drive;          /* Physical drive, card type from disk_initialize */
     BYTE    csize;          /* Number of sectors per cluster */
 #if S_MAX_SIZ > 512U
     WORD    s_size;         /* Sector size */
@@ -203,7 +206,7 @@ typedef struct _FIL {
     DWORD   dir_sect;       /* Sector containing the directory entry */
     BYTE*   dir_ptr;        /* Ponter to the directory entry in the window */
 #endif
-#if _USE_LESS_BUF == 0 && _USE_1_BUF == 0
+#if _USE_FS_BUF == 0
     BUF   buf;              /* File R/W buffer */
 #endif
 } FIL;
@@ -310,6 +313,7 @@ FRESULT f_chdir (const UCHAR*);                             /* Change current di
 /* Low Level functions */
 FRESULT l_openroot(FATFS* fs, DIR *dirobj);                 /* open the root directory */
 FRESULT l_openfile(FATFS *fs, FILINFO *fi, FIL *fp);        /* Open a file based on its FILINFO struct */
+FRESULT l_read_crc(FIL *fp, void *buff, WORD *crc);         /* Read a sector and update a CRC */
 FRESULT l_getfree (FATFS*, const UCHAR*, DWORD*, DWORD);    /* Get number of free clusters on the drive, limited */
 
 #if _USE_STRFUNC
@@ -351,6 +355,17 @@ DWORD get_fattime (void); /* 31-25: Year(0-127 org.1980), 24-21: Month(1-12), 20
 #define FS_FAT12    1
 #define FS_FAT16    2
 #define FS_FAT32    3
+#define FS_RAW      4   /* raw firmware partition, see mount_drv */
+
+
+/* Raw firmware partition (CONFIG_RAW_PARTITION) */
+
+#define RAW_PARTITION_TYPE  0xda    /* "non-FS data" */
+#define MOUNT_RAW           0x80    /* f_mount drive flag: accept a raw partition */
+
+/* f_mount drive flag: the card was already initialized (CONFIG_BACKGROUND_CRC, */
+/* CONFIG_WARM_START) and its type is in FATFS.drive                             */
+#define MOUNT_INITIALIZED   0x40
 
 
 /* File attribute bits for directory entry */
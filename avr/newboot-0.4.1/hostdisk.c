@@ -0,0 +1,160 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   hostdisk.c: Card images as disks for ff.c on the host
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#endif
+#include "diskio.h"
+#include "hostdisk.h"
+
+static struct hostcard *cards[256];
+static __thread uint8_t current_slot;
+
+void hostdisk_select(uint8_t slot, struct hostcard *card) {
+  cards[slot]  = card;
+  current_slot = slot;
+}
+
+/* same as _crc_ccitt_update from avr-libc */
+static uint16_t crc_ccitt_update(uint16_t crc, uint8_t data) {
+  data ^= crc & 0xff;
+  data ^= data << 4;
+
+  return (((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
+    ^ ((uint16_t)data << 3);
+}
+
+DSTATUS disk_initialize(BYTE *type) {
+  *type = current_slot;
+  if (cards[current_slot] == NULL || cards[current_slot]->data == NULL)
+    return STA_NOINIT;
+
+  return 0;
+}
+
+DRESULT disk_read_crc(BYTE type, BYTE *buffer, DWORD sector, WORD *crc) {
+  struct hostcard *card = cards[type];
+  uint16_t i;
+
+  if (sector >= card->sectors)
+    return RES_ERROR;
+
+  memcpy(buffer, card->data + (uint64_t)sector * 512, 512);
+  card->reads++;
+  if (card->read_hook)
+    card->read_hook(card, sector);
+
+  if (crc)
+    for (i=0; i<512; i++)
+      *crc = crc_ccitt_update(*crc, buffer[i]);
+
+  return RES_OK;
+}
+
+DRESULT disk_read(BYTE type, BYTE *buffer, DWORD sector) {
+  return disk_read_crc(type, buffer, sector, NULL);
+}
+
+int hostcard_open(struct hostcard *card, const char *name) {
+  card->data      = NULL;
+  card->reads     = 0;
+  card->read_hook = NULL;
+#ifdef _WIN32
+  FILE  *f = fopen(name, "rb");
+  long   size;
+  uint8_t *data;
+
+  if (f == 0 || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0) {
+    printf("Unable to open file %s\r\n", name);
+    if (f)
+      fclose(f);
+    return 1;
+  }
+  card->sectors = size / 512;
+  data = malloc(size ? size : 1);
+  fseek(f, 0, SEEK_SET);
+  if (!data || fread(data, 1, size, f) != (size_t)size) {
+    perror(name);
+    free(data);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+  card->data = data;
+#else
+  int   fd = open(name, O_RDONLY);
+  off_t size;
+  void *data;
+
+  /* st_size is 0 for block devices */
+  if (fd < 0 || (size = lseek(fd, 0, SEEK_END)) < 0) {
+    printf("Unable to open file %s\r\n", name);
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  card->sectors = size / 512;
+  if (card->sectors == 0) {
+    printf("%s is empty\r\n", name);
+    close(fd);
+    return 1;
+  }
+
+  data = mmap(NULL, card->sectors * 512, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(name);
+    return 1;
+  }
+  card->data = data;
+#endif
+  return 0;
+}
+
+void hostcard_close(struct hostcard *card) {
+  if (card->data == NULL)
+    return;
+#ifdef _WIN32
+  free((void *)card->data);
+#else
+  munmap((void *)card->data, card->sectors * 512);
+#endif
+  card->data = NULL;
+}
@@ -0,0 +1,63 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   hostdisk.h: Card images as disks for ff.c on the host
+
+   The card type that disk_initialize returns to ff.c is used as an
+   index into a table of up to 256 mapped card images. Each thread
+   selects the slot it uses before calling into ff.c, so several
+   threads can work on different cards at the same time.
+
+*/
+
+#ifndef HOSTDISK_H
+#define HOSTDISK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct hostcard {
+  const uint8_t *data;     /* contents of the card */
+  uint64_t       sectors;  /* size of the card in sectors */
+  unsigned long  reads;    /* number of sectors read so far */
+  /* called for every sector read, may be NULL */
+  void         (*read_hook)(struct hostcard *card, uint32_t sector);
+  void          *ctx;
+};
+
+/* use card for all disks initialized by the calling thread */
+void hostdisk_select(uint8_t slot, struct hostcard *card);
+
+/* map a card image or block device, returns 0 on success */
+int  hostcard_open(struct hostcard *card, const char *name);
+void hostcard_close(struct hostcard *card);
+
+#endif
@@ -0,0 +1,401 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   imagecheck.h: Image selection rules shared with the host tools
+
+   The functions in this file decide if a file on the card is an image
+   for this device and if it should replace the application in flash.
+   They only use the FatFs functions and the parameters passed to them,
+   so cardaudit can link them with the same ff.c on the host. The boot
+   loader passes its compile-time constants, the compiler folds them.
+   img_select is the directory search itself, the boot loader and
+   cardaudit only differ in the callbacks they pass to it.
+
+*/
+
+#ifndef IMAGECHECK_H
+#define IMAGECHECK_H
+
+#include <stdint.h>
+#include <string.h>
+#include "ff.h"
+
+typedef struct {
+  uint32_t device_id;
+  uint16_t version;
+  uint16_t crc;
+} bootinfo_t;
+
+/* Length of a variable-length image, stored in front of bootinfo_t */
+typedef struct {
+  uint16_t sectors;   /* number of sectors before the tag sector */
+  uint16_t check;     /* ~sectors */
+} imagelen_t;
+
+/* Result of the checks, IMG_OK if the image was accepted */
+typedef enum {
+  IMG_OK = 0,
+  IMG_READ,      /* read error */
+  IMG_CRC,       /* CRC over the file is not 0 */
+  IMG_DEVICE,    /* tag names another device */
+  IMG_LENGTH,    /* file size does not match the imagelen_t */
+  IMG_SAME,      /* development build already in flash */
+  IMG_OLDER,     /* version not newer than the one in flash */
+  IMG_FORMAT,    /* not a bundle file */
+  IMG_BELOW      /* acceptable, but ranks below the best file so far */
+} imgresult_t;
+
+/* A bundle file starts with an index sector that lists the images in */
+/* it, followed by the images themselves. Each entry repeats the tag  */
+/* of its image, so the boot loader can decide from the index alone   */
+/* if an image needs a closer look. The last two bytes of the index   */
+/* sector are a CRC over the sector.                                  */
+#define BUNDLE_MAGIC   0x5842424eUL   /* "NBBX" */
+#define BUNDLE_ENTRIES 31
+
+typedef struct {
+  uint32_t device_id;
+  uint16_t version;
+  uint16_t crc;        /* tag CRC of the image */
+  uint32_t offset;     /* start of the image in the file, multiple of 512 */
+  uint32_t length;     /* size of the image */
+} bundle_entry_t;
+
+typedef struct {
+  uint32_t       magic;
+  uint8_t        count;
+  uint8_t        reserved[3];
+  bundle_entry_t entry[BUNDLE_ENTRIES];
+} bundle_index_t;
+
+/* number of sectors of an image in an application area of length bytes */
+static inline uint16_t img_sectors(uint32_t length, uint16_t sectors, uint16_t check) {
+  if (sectors == (uint16_t)~check && sectors < length/512)
+    return sectors + 1;
+  else
+    return length/512;
+}
+
+/* returns 1 if a file of size bytes can be an image. A variable-length */
+/* file consists of the used part of the application area followed by  */
+/* a tag sector that is flashed to the last sector of the area.        */
+static inline uint8_t img_candidate(uint32_t length, uint8_t varlen, uint32_t size) {
+  if (varlen)
+    return size <= length && size >= 512 && (size & 511) == 0;
+  else
+    return size == length;
+}
+
+/* returns 1 if a file of size bytes can be a bundle. Bundles are */
+/* always larger than the application area, see crcgen -B.        */
+static inline uint8_t img_bundle_candidate(uint32_t length, uint32_t size) {
+  return size > length && (size & 511) == 0;
+}
+
+/* check the tag sector of a file of fsize bytes and copy its tag to bi */
+static inline imgresult_t img_check_tag(const uint8_t *sector, uint32_t fsize,
+                                        uint32_t devid, uint32_t length,
+                                        uint8_t varlen, bootinfo_t *bi) {
+  memcpy(bi, sector + 512 - sizeof(bootinfo_t), sizeof(bootinfo_t));
+
+  if (bi->device_id != devid)
+    return IMG_DEVICE;
+
+  if (varlen) {
+    const imagelen_t *il = (const imagelen_t *)(sector + 512 - sizeof(bootinfo_t)
+                                                - sizeof(imagelen_t));
+
+    if (fsize != (uint32_t)img_sectors(length, il->sectors, il->check) * 512)
+      return IMG_LENGTH;
+  }
+
+  return IMG_OK;
+}
+
+/* read the image from offset to the end of the file, check its CRC */
+/* and its tag. buf holds the tag sector afterwards.                */
+static inline imgresult_t img_check_file(FATFS *fs, FILINFO *fi, FIL *fp,
+                                         uint8_t *buf, uint32_t offset,
+                                         uint32_t devid, uint32_t length,
+                                         uint8_t varlen, bootinfo_t *bi) {
+  uint16_t crc = 0xffff;
+  uint16_t remain = (fi->fsize - offset) / 512;
+
+  /* open file, can't fail */
+  l_openfile(fs, fi, fp);
+
+  if (offset && f_lseek(fp, offset) != FR_OK)
+    return IMG_READ;
+
+  while (remain) {
+    if (l_read_crc(fp, buf, &crc) != FR_OK)
+      return IMG_READ;
+
+    remain--;
+  }
+
+  if (crc != 0)
+    return IMG_CRC;
+
+  return img_check_tag(buf, fi->fsize - offset, devid, length, varlen, bi);
+}
+
+/* read only the last sector of the image at offset and check its tag */
+static inline imgresult_t img_read_tag(FATFS *fs, FILINFO *fi, FIL *fp,
+                                       uint8_t *buf, uint32_t offset,
+                                       uint32_t devid, uint32_t length,
+                                       uint8_t varlen, bootinfo_t *bi) {
+  /* open file, can't fail */
+  l_openfile(fs, fi, fp);
+
+  if (f_lseek(fp, fi->fsize - 512) != FR_OK ||
+      f_read(fp, buf, 512) != FR_OK)
+    return IMG_READ;
+
+  return img_check_tag(buf, fi->fsize - offset, devid, length, varlen, bi);
+}
+
+/* read the index of a bundle and look up the entry for devid. On     */
+/* success offset is set to the start of the image, fi->fsize is cut  */
+/* back to its end and bi holds the tag from the index.               */
+static inline imgresult_t img_read_bundle(FATFS *fs, FILINFO *fi, FIL *fp,
+                                          uint8_t *buf, uint32_t devid,
+                                          uint32_t length, uint8_t varlen,
+                                          uint32_t *offset, bootinfo_t *bi) {
+  const bundle_index_t *idx = (const bundle_index_t *)buf;
+  uint16_t crc = 0xffff;
+  uint8_t  i;
+
+  /* open file, can't fail */
+  l_openfile(fs, fi, fp);
+
+  if (l_read_crc(fp, buf, &crc) != FR_OK)
+    return IMG_READ;
+
+  if (crc != 0 || idx->magic != BUNDLE_MAGIC)
+    return IMG_FORMAT;
+
+  for (i = 0; i < idx->count && i < BUNDLE_ENTRIES; i++) {
+    const bundle_entry_t *e = &idx->entry[i];
+
+    if (e->device_id != devid)
+      continue;
+
+    bi->device_id = e->device_id;
+    bi->version   = e->version;
+    bi->crc       = e->crc;
+
+    if ((e->offset & 511) || e->offset < 512 || e->offset > fi->fsize ||
+        e->length > fi->fsize - e->offset ||
+        !img_candidate(length, varlen, e->length))
+      return IMG_LENGTH;
+
+    *offset   = e->offset;
+    fi->fsize = e->offset + e->length;
+    return IMG_OK;
+  }
+
+  return IMG_DEVICE;
+}
+
+/* check if the tag bi should replace the application with the given */
+/* tag fields in flash. retry allows rewriting the same version.     */
+static inline imgresult_t img_accept(const bootinfo_t *bi, uint16_t flash_version,
+                                     uint16_t flash_crc, uint8_t retry) {
+  /* dev mode */
+  if (bi->version == 0 &&
+      bi->crc != flash_crc)
+    return IMG_OK;
+
+  /* check version */
+  if (flash_version == 0xffff ||
+      bi->version > flash_version)
+    return IMG_OK;
+
+  /* rewrite the same version if the last update did not work */
+  if (retry && bi->version == flash_version)
+    return IMG_OK;
+
+  return bi->version == 0 ? IMG_SAME : IMG_OLDER;
+}
+
+/* returns 1 if the image tagged a should be flashed instead of the   */
+/* one tagged b when both are acceptable. A development build ranks   */
+/* above all versions, among them the first one found is kept.        */
+static inline uint8_t img_better(const bootinfo_t *a, const bootinfo_t *b) {
+  if (b->version == 0)
+    return 0;
+
+  return a->version == 0 || a->version > b->version;
+}
+
+/* Settings, state and result of a search for the best image */
+typedef struct img_select img_select_t;
+
+struct img_select {
+  /* objects used by the search, the current entry is in fi, its tag */
+  /* in bi and the start of the image in it in offset                */
+  FATFS      *fs;
+  DIR        *dir;
+  FILINFO    *fi;
+  FIL        *fp;
+  uint8_t    *buf;
+  bootinfo_t *bi;
+  uint32_t    offset;
+  DIR        *pos;      /* directory position before fi, may be NULL */
+
+  /* settings of the boot loader */
+  uint32_t    devid;
+  uint32_t    length;
+  uint8_t     varlen;
+  uint8_t     single_pass;
+  uint8_t     bundles;
+
+  /* called for every directory entry before it is checked, a non-zero */
+  /* return value abandons the search. May be NULL.                    */
+  uint8_t     (*entry)(img_select_t *s);
+  /* checks if the tag in bi may replace the application in flash */
+  imgresult_t (*accept)(img_select_t *s);
+  /* called with the result for every checked file: IMG_OK when it    */
+  /* becomes the best file (best still holds the previous one), else */
+  /* the reason it was rejected. May be NULL.                        */
+  void        (*result)(img_select_t *s, imgresult_t res);
+  void        *ctx;
+
+  /* the best file found */
+  uint8_t     found;
+  FILINFO     best;
+  bootinfo_t  best_bi;
+  uint32_t    best_offset;
+};
+
+/* check an image that fills the raw firmware partition mounted in fs */
+static inline imgresult_t img_check_raw(img_select_t *s) {
+  imgresult_t res;
+
+  /* mount_drv presents the partition as a single cluster */
+  s->fi->clust = 2;
+  s->fi->fsize = (uint32_t)s->fs->csize * 512;
+  s->offset    = 0;
+
+  if (!img_candidate(s->length, s->varlen, s->fi->fsize))
+    return IMG_LENGTH;
+
+  if (s->single_pass)
+    res = img_read_tag(s->fs, s->fi, s->fp, s->buf, 0, s->devid,
+                       s->length, s->varlen, s->bi);
+  else
+    res = img_check_file(s->fs, s->fi, s->fp, s->buf, 0, s->devid,
+                         s->length, s->varlen, s->bi);
+
+  return res == IMG_OK ? s->accept(s) : res;
+}
+
+/* check the entry in fi and make it the best file if it beats it */
+static inline imgresult_t img_select_entry(img_select_t *s) {
+  imgresult_t res;
+
+  s->offset = 0;
+  s->bi->device_id = 0;
+
+  /* large files may be bundles, only the index and */
+  /* the image for this device are read from them   */
+  if (s->bundles && img_bundle_candidate(s->length, s->fi->fsize)) {
+    uint32_t offset = 0;
+
+    res = img_read_bundle(s->fs, s->fi, s->fp, s->buf, s->devid, s->length,
+                          s->varlen, &offset, s->bi);
+    s->offset = offset;
+    if (res == IMG_OK)
+      res = s->accept(s);
+    if (res != IMG_OK)
+      return res;
+  }
+
+  if (!img_candidate(s->length, s->varlen, s->fi->fsize - s->offset))
+    return IMG_FORMAT;
+
+  /* the CRC is only checked for files that beat the best one so far */
+  res = img_read_tag(s->fs, s->fi, s->fp, s->buf, s->offset, s->devid,
+                     s->length, s->varlen, s->bi);
+  if (res == IMG_OK)
+    res = s->accept(s);
+  if (res == IMG_OK && s->found && !img_better(s->bi, &s->best_bi))
+    res = IMG_BELOW;
+  if (res == IMG_OK && !s->single_pass)
+    res = img_check_file(s->fs, s->fi, s->fp, s->buf, s->offset, s->devid,
+                         s->length, s->varlen, s->bi);
+
+  return res;
+}
+
+/* search the root directory for the best image. Returns 1 if the */
+/* complete directory was read, the result is in found and best.  */
+/* A search abandoned by the entry callback finds nothing.        */
+static inline uint8_t img_select(img_select_t *s) {
+  imgresult_t res;
+
+  s->found = 0;
+  l_openroot(s->fs, s->dir);
+
+  while (1) {
+    if (s->pos)
+      memcpy(s->pos, s->dir, sizeof(DIR));
+
+    if (f_readdir(s->dir, s->fi) != FR_OK)
+      return 0;
+    if (s->fi->fname[0] == 0)
+      return 1;
+
+    if (s->entry && s->entry(s)) {
+      s->found = 0;
+      return 0;
+    }
+
+    res = img_select_entry(s);
+
+    /* not an image file at all */
+    if (res == IMG_FORMAT)
+      continue;
+
+    if (s->result)
+      s->result(s, res);
+
+    if (res == IMG_OK) {
+      memcpy(&s->best, s->fi, sizeof(FILINFO));
+      s->best_bi     = *s->bi;
+      s->best_offset = s->offset;
+      s->found       = 1;
+    }
+  }
+}
+
+#endif
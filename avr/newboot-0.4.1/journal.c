@@ -0,0 +1,201 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   journal.c: EEPROM journal for interrupted updates
+
+   The journal consists of a header that identifies the image that is
+   being flashed and a ring of progress slots. The header is written
+   once when the update starts, progress records are spread over all
+   slots to reduce EEPROM wear. A slot belongs to the current update
+   if its generation number matches the one in the header.
+
+*/
+
+#include <stddef.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "bootapi.h"
+#include "journal.h"
+
+typedef struct {
+  uint32_t clust;
+  uint32_t fsize;
+  uint16_t offset;
+  uint16_t tag_crc;
+  uint8_t  gen;
+  uint16_t crc;
+} journal_header_t;
+
+typedef struct {
+  uint8_t  gen;
+  uint16_t sectors;
+} journal_slot_t;
+
+#define JOURNAL_SLOT_COUNT 16
+
+#define header ((journal_header_t *)EE_JOURNAL_HEADER)
+#define slots  ((journal_slot_t *)EE_JOURNAL_SLOTS)
+
+static uint8_t current_gen;
+static uint8_t next_slot;
+
+static uint16_t header_crc(journal_header_t *hdr) {
+  uint8_t *ptr = (uint8_t *)hdr;
+  uint16_t crc = 0xffff;
+  uint8_t  i;
+
+  for (i=0; i<offsetof(journal_header_t, crc); i++)
+    crc = _crc_ccitt_update(crc, *ptr++);
+
+  return crc;
+}
+
+/* Returns the highest progress recorded with generation number gen and */
+/* points next_slot behind the slot that holds it, so the ring continues */
+/* there instead of wearing out the first slots.                         */
+static uint16_t find_newest(uint8_t gen) {
+  journal_slot_t slot;
+  uint16_t sectors = 0;
+  uint8_t i;
+
+  next_slot = 0;
+  for (i=0; i<JOURNAL_SLOT_COUNT; i++) {
+    eeprom_read_block(&slot, &slots[i], sizeof(slot));
+    if (slot.gen == gen && slot.sectors > sectors) {
+      sectors   = slot.sectors;
+      next_slot = i+1;
+    }
+  }
+
+  if (next_slot == JOURNAL_SLOT_COUNT)
+    next_slot = 0;
+
+  return sectors;
+}
+
+/**
+ * journal_read - check for an interrupted update
+ * @j: journal_t structure to fill
+ *
+ * This function returns 1 if the journal records an update that was not
+ * finished and fills @j with the data of that update. If there is no
+ * such update, 0 is returned.
+ */
+uint8_t journal_read(journal_t *j) {
+  journal_header_t hdr;
+
+  eeprom_read_block(&hdr, header, sizeof(hdr));
+  if (hdr.crc != header_crc(&hdr))
+    return 0;
+
+  j->clust   = hdr.clust;
+  j->fsize   = hdr.fsize;
+  j->offset  = hdr.offset;
+  j->tag_crc = hdr.tag_crc;
+  j->sectors = find_newest(hdr.gen);
+
+  current_gen = hdr.gen;
+
+  return 1;
+}
+
+/**
+ * journal_open - start a new journal
+ * @clust  : start cluster of the image file
+ * @fsize  : size of the image file
+ * @offset : first sector of the image in a bundle file, 0 otherwise
+ * @tag_crc: CRC field of the image tag
+ *
+ * This function records the identity of the image that is about to be
+ * flashed. It must be called before the first flash page is erased.
+ */
+void journal_open(uint32_t clust, uint32_t fsize, uint16_t offset,
+                  uint16_t tag_crc) {
+  journal_header_t hdr;
+  uint8_t i;
+
+  /* continue the ring after the last update, then select a new */
+  /* generation number, 0xff is the erased state                 */
+  current_gen = eeprom_read_byte(&header->gen);
+  find_newest(current_gen);
+  if (++current_gen == 0xff)
+    current_gen = 0;
+
+  /* slots that still carry this number are left from a much older update */
+  for (i=0; i<JOURNAL_SLOT_COUNT; i++)
+    if (eeprom_read_byte(&slots[i].gen) == current_gen)
+      eeprom_update_byte(&slots[i].gen, 0xff);
+
+  hdr.clust   = clust;
+  hdr.fsize   = fsize;
+  hdr.offset  = offset;
+  hdr.tag_crc = tag_crc;
+  hdr.gen     = current_gen;
+  hdr.crc     = header_crc(&hdr);
+  eeprom_update_block(&hdr, header, sizeof(hdr));
+
+  /* SPM is blocked while the EEPROM is busy */
+  eeprom_busy_wait();
+}
+
+/**
+ * journal_progress - record update progress
+ * @sectors: number of sectors that have been completely flashed
+ *
+ * This function records that the first @sectors sectors of the image
+ * have been flashed and must only be called after journal_open.
+ */
+void journal_progress(uint16_t sectors) {
+  journal_slot_t slot;
+
+  slot.gen     = current_gen;
+  slot.sectors = sectors;
+  eeprom_update_block(&slot, &slots[next_slot], sizeof(slot));
+
+  if (++next_slot == JOURNAL_SLOT_COUNT)
+    next_slot = 0;
+
+  eeprom_busy_wait();
+}
+
+/**
+ * journal_close - mark the journal as finished
+ *
+ * This function invalidates the journal header so the next boot does
+ * not try to resume the update.
+ */
+void journal_close(void) {
+  journal_header_t hdr;
+
+  eeprom_read_block(&hdr, header, sizeof(hdr));
+  eeprom_update_word(&header->crc, ~header_crc(&hdr));
+  eeprom_busy_wait();
+}
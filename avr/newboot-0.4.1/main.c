@@ -36,14 +36,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <avr/boot.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/power.h>
+#include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <util/delay.h>
 #include <util/crc16.h>
 #include "config.h"
+#include "bootapi.h"
+#include "crc.h"
+#include "diskio.h"
 #include "ff.h"
+#include "imagecheck.h"
+#ifdef CONFIG_UPDATE_JOURNAL
+#  include "journal.h"
+#endif
 
 #ifdef __AVR_ATmega1284P__
 /* fix an issue with the avr-libc from Debian lenny */
@@ -60,11 +69,41 @@
 
 #define min(a,b) ((a)<(b)?(a):(b))
 
-typedef struct {
-  uint32_t device_id;
-  uint16_t version;
-  uint16_t crc;
-} bootinfo_t;
+/* read a field of the tag in flash */
+#define flash_tag_word(field) \
+  flash_read_word(BINARY_LENGTH - sizeof(bootinfo_t) + offsetof(bootinfo_t, field))
+
+#ifdef CONFIG_VARIABLE_LENGTH
+#  define VARIABLE_LENGTH 1
+#else
+#  define VARIABLE_LENGTH 0
+#endif
+
+#ifdef CONFIG_SINGLE_PASS_UPDATE
+#  define SINGLE_PASS 1
+#else
+#  define SINGLE_PASS 0
+#endif
+
+#ifdef CONFIG_BUNDLE
+#  define BUNDLES 1
+#else
+#  define BUNDLES 0
+#endif
+
+#define candidate_size(s) img_candidate(BINARY_LENGTH, VARIABLE_LENGTH, s)
+
+#ifdef CONFIG_BUNDLE
+#  define bundle_candidate(s) img_bundle_candidate(BINARY_LENGTH, s)
+#endif
+
+#if defined(CONFIG_BACKGROUND_CRC) || defined(CONFIG_WARM_START)
+/* try_update initializes the card before mounting it */
+#  define EARLY_CARD_INIT
+#  define MOUNT_FLAGS MOUNT_INITIALIZED
+#else
+#  define MOUNT_FLAGS 0
+#endif
 
 static FATFS fat;
 static DIR dh;
@@ -74,159 +113,1187 @@ static FIL fd;
 static bootinfo_t file_bi;
 static uint8_t databuffer[512];
 
-static void flash_file(void) {
-  uint32_t address;
-  uint16_t remain = BINARY_LENGTH/512;
+#ifdef CONFIG_SINGLE_PASS_UPDATE
+/* number of times a single-pass update wrote an image with a bad CRC */
+#  define SINGLE_PASS_RETRIES 2
+static uint8_t bad_passes;
+/* set when the application in flash failed its CRC check */
+static uint8_t app_corrupt;
+#endif
+
+#ifdef CONFIG_VERIFY_FLASH
+/* set when flash_file has written and verified a complete image */
+static uint8_t app_verified;
+#endif
+
+#ifdef CONFIG_DIR_HINT
+/* location of the directory entry of the last image seen in the chip */
+typedef struct {
+  uint16_t volume;     /* CRC of the geometry and the root directory */
+  uint32_t sect;       /* DIR state before reading the entry */
+  uint32_t clust;
+  uint16_t index;
+  uint32_t file_clust; /* start cluster of the file */
+  uint32_t fsize;      /* size of the file */
+  uint16_t tag_crc;    /* crc field of the tag */
+  uint16_t crc;        /* CRC of the hint */
+} dir_hint_t;
+
+/* DIR state before the entry of the current candidate was read */
+static DIR hint_pos;
+static uint8_t hint_tried;
+
+/* fingerprint of the directory entries read so far and the size */
+/* of the current entry before a bundle lookup cut it back        */
+static uint16_t hint_volume;
+static uint32_t hint_size;
+
+/* hint for the file that is in the chip, if the search found it, */
+/* and for the best file, which is in the chip after flashing it  */
+static dir_hint_t hint_chip;
+static uint8_t hint_chip_found;
+static dir_hint_t hint_best;
+#endif
+
+#if defined(CONFIG_SINGLE_PASS_UPDATE) || defined(CONFIG_VERIFY_FLASH)
+#  define CRC_WHILE_FLASHING
+#endif
+
+#ifdef CONFIG_BUNDLE
+/* start of the image in the file in finfo, finfo.fsize is its end */
+static uint32_t image_offset;
+#else
+#  define image_offset 0
+#endif
+
+#ifdef CONFIG_CARD_HANDOFF
+/* set when fat holds an initialized card and a mounted file system */
+static uint8_t card_mounted;
+#endif
+
+#if defined(CONFIG_WARM_START) || defined(CONFIG_BOOT_DEADLINE) || \
+    defined(CONFIG_SD_TRACE)
+/* MCUSR at reset, saved before main runs */
+static uint8_t reset_flags __attribute__((section(".noinit")));
+#endif
+
+#ifdef CONFIG_VARIABLE_LENGTH
+/* returns the number of sectors of an image based on its imagelen_t */
+static uint16_t image_sectors(uint16_t sectors, uint16_t check) {
+  return img_sectors(BINARY_LENGTH, sectors, check);
+}
+
+/* returns 1 if a page of data only contains 0xff */
+static uint8_t page_empty(const uint16_t *ptr) {
+  uint8_t j;
+
+  for (j=0; j<SPM_PAGESIZE/2; j++)
+    if (*ptr++ != 0xffff)
+      return 0;
+
+  return 1;
+}
+#endif
+
+/* calculate the CRC of the flash contents from start to end */
+static uint16_t flash_crc(uint16_t crc, uint32_t start, uint32_t end) {
+#if BINARY_LENGTH < 64*1024
+  return crc_ccitt_flash(crc, start, end - start);
+#elif BINARY_LENGTH < 128*1024
+  /* crc_ccitt_flash only reaches the lower 64K */
+  while (start < end && start < 65536) {
+    uint16_t len = min(min(end, 65536UL) - start, 0x8000);
+
+    crc = crc_ccitt_flash(crc, start, len);
+    start += len;
+  }
+
+  for (; start < end; start++)
+    crc = _crc_ccitt_update(crc, pgm_read_byte_far(start));
+
+  return crc;
+#else
+#  error FIXME: Devices larger than 128K not supported yet
+#endif
+}
+
+#ifdef CONFIG_VARIABLE_LENGTH
+/* number of sectors of the application in flash, including the tag sector */
+static uint16_t app_sectors(void) {
+  return image_sectors(
+    flash_read_word(BINARY_LENGTH - sizeof(bootinfo_t) - sizeof(imagelen_t)
+                    + offsetof(imagelen_t, sectors)),
+    flash_read_word(BINARY_LENGTH - sizeof(bootinfo_t) - sizeof(imagelen_t)
+                    + offsetof(imagelen_t, check)));
+}
+#endif
+
+#ifdef CONFIG_BACKGROUND_CRC
+/* The application CRC is calculated in steps of CRC_STEP bytes while */
+/* disk_initialize waits for the card. Writing to the flash restarts  */
+/* it, app_crc finishes whatever is left.                              */
+#  define CRC_STEP 256
+
+static uint8_t  crc_started;
+static uint32_t crc_pos;    /* next address to check */
+#  ifdef CONFIG_VARIABLE_LENGTH
+static uint32_t crc_skip;   /* end of the used part of the application area */
+#  endif
+static uint16_t crc_value;
+
+/* advance the CRC of the application by one step */
+static void app_crc_step(void) {
+  uint32_t end = BINARY_LENGTH;
+
+  if (!crc_started) {
+    crc_started = 1;
+    crc_pos     = 0;
+    crc_value   = 0xffff;
+#  ifdef CONFIG_VARIABLE_LENGTH
+    crc_skip    = (uint32_t)(app_sectors() - 1) * 512;
+#  endif
+  }
+
+#  ifdef CONFIG_VARIABLE_LENGTH
+  /* used part of the application area and the tag sector */
+  if (crc_pos == crc_skip)
+    crc_pos = BINARY_LENGTH - 512;
+  if (crc_pos < crc_skip)
+    end = crc_skip;
+#  endif
+
+  if (crc_pos < BINARY_LENGTH) {
+    end = min(end, crc_pos + CRC_STEP);
+    crc_value = flash_crc(crc_value, crc_pos, end);
+    crc_pos = end;
+  }
+}
+
+/* calculate the CRC of the application, 0 if it is valid */
+static uint16_t app_crc(void) {
+  do {
+    app_crc_step();
+  } while (crc_pos < BINARY_LENGTH);
+
+  return crc_value;
+}
+#else
+/* calculate the CRC of the application, 0 if it is valid */
+static uint16_t app_crc(void) {
+  uint16_t crc = 0xffff;
+
+#  ifdef CONFIG_VARIABLE_LENGTH
+  uint16_t sectors = app_sectors();
+
+  /* used part of the application area and the tag sector */
+  crc = flash_crc(crc, 0, (uint32_t)(sectors - 1) * 512);
+  crc = flash_crc(crc, BINARY_LENGTH - 512, BINARY_LENGTH);
+#  else
+  crc = flash_crc(crc, 0, BINARY_LENGTH);
+#  endif
+
+  return crc;
+}
+#endif
+
+#ifdef CONFIG_BOOT_DEADLINE
+/* A search of the card is abandoned CONFIG_BOOT_DEADLINE ms after   */
+/* reset if the application in flash is valid. Timer 1 measures the */
+/* deadline and is checked between directory entries, the watchdog   */
+/* ends searches that hang in the card driver. Both are disarmed     */
+/* before the flash is changed.                                      */
+#  define DEADLINE_TICKS (F_CPU / 1024 * CONFIG_BOOT_DEADLINE / 1000)
+#  if DEADLINE_TICKS > 65535
+#    error "CONFIG_BOOT_DEADLINE is too long for Timer 1 at this clock"
+#  endif
+
+/* shortest watchdog timeout above the deadline, a step equal to the */
+/* deadline could fire first because the watchdog clock is inexact   */
+#  if CONFIG_BOOT_DEADLINE < 120
+#    define DEADLINE_WDTO WDTO_120MS
+#  elif CONFIG_BOOT_DEADLINE < 250
+#    define DEADLINE_WDTO WDTO_250MS
+#  elif CONFIG_BOOT_DEADLINE < 500
+#    define DEADLINE_WDTO WDTO_500MS
+#  elif CONFIG_BOOT_DEADLINE < 1000
+#    define DEADLINE_WDTO WDTO_1S
+#  elif CONFIG_BOOT_DEADLINE < 2000
+#    define DEADLINE_WDTO WDTO_2S
+#  elif CONFIG_BOOT_DEADLINE < 4000
+#    define DEADLINE_WDTO WDTO_4S
+#  elif CONFIG_BOOT_DEADLINE < 8000
+#    define DEADLINE_WDTO WDTO_8S
+#  else
+#    error "CONFIG_BOOT_DEADLINE must be less than 8000"
+#  endif
+
+#  define DEADLINE_MAGIC 0x4e42444cUL   /* "NBDL" */
+
+/* set while the watchdog guards a search, survives the watchdog reset */
+static uint32_t deadline_marker __attribute__((section(".noinit")));
+static uint8_t  deadline_armed;
+/* set when the search was abandoned for a valid application */
+static uint8_t  deadline_app_valid;
+
+static void deadline_arm(void) {
+  TCNT1  = 0;
+  OCR1A  = DEADLINE_TICKS;
+  TIFR1  = _BV(OCF1A);
+  TCCR1B = _BV(CS12) | _BV(CS10);   /* F_CPU/1024 */
+
+  deadline_marker = DEADLINE_MAGIC;
+  deadline_armed  = 1;
+  wdt_enable(DEADLINE_WDTO);
+}
+
+/* stop the watchdog, Timer 1 runs on until try_start_app */
+static void deadline_disarm(void) {
+  if (!deadline_armed)
+    return;
+
+  wdt_disable();
+  deadline_marker = 0;
+  deadline_armed  = 0;
+}
+
+/* count a search that was abandoned */
+static void deadline_record(uint8_t reason) {
+  uint16_t count = eeprom_read_word((uint16_t *)EE_DEADLINE_OVERRUNS);
+
+  if (count == 0xffff)
+    count = 0;
+  if (count < 0xfffe)
+    count++;
+
+  eeprom_update_word((uint16_t *)EE_DEADLINE_OVERRUNS, count);
+  eeprom_update_byte((uint8_t *)EE_DEADLINE_REASON, reason);
+  eeprom_busy_wait();
+}
+
+/* returns 1 if the search should be abandoned for the application */
+static uint8_t deadline_expired(void) {
+  if (!deadline_armed || !(TIFR1 & _BV(OCF1A)))
+    return 0;
+
+  deadline_disarm();
+
+  /* without a valid application the search has to go on */
+  if (app_crc() != 0)
+    return 0;
+
+  deadline_app_valid = 1;
+  deadline_record(DEADLINE_POLLED);
+  return 1;
+}
+
+/* returns 1 if the watchdog ended the last search */
+static uint8_t deadline_reset(void) {
+  if (!(reset_flags & _BV(WDRF)) || deadline_marker != DEADLINE_MAGIC)
+    return 0;
+
+  deadline_marker = 0;
+  deadline_record(DEADLINE_WATCHDOG);
+  return 1;
+}
+#else
+#  define deadline_disarm() do {} while (0)
+#  define deadline_expired() 0
+#endif
+
+/* write the sector in databuffer to the flash, returns 0 if */
+/* the written data could not be read back correctly         */
+static uint8_t flash_sector(uint32_t address) {
+  uint16_t *ptr = (uint16_t *)databuffer;
   uint8_t  i,j;
-  uint16_t *ptr;
+  uint8_t  verified = 1;
+
+#ifdef CONFIG_BACKGROUND_CRC
+  /* the CRC calculated so far no longer applies */
+  crc_started = 0;
+#endif
+
+  for (i=0; i < 512 / SPM_PAGESIZE; i++) {
+    /* erase page */
+    boot_page_erase(address);
+    boot_spm_busy_wait();
+
+#ifdef CONFIG_VARIABLE_LENGTH
+    /* an erased page is already filled with 0xff */
+    if (!page_empty(ptr))
+#endif
+    {
+      /* copy new contents */
+      for (j=0; j<SPM_PAGESIZE/2; j++)
+        boot_page_fill(address + j*2, ptr[j]);
+
+      /* write page */
+      boot_page_write(address);
+      boot_spm_busy_wait();
+    }
+
+#ifdef CONFIG_VERIFY_FLASH
+    /* read back page */
+    boot_rww_enable();
+    for (j=0; j<SPM_PAGESIZE/2; j++)
+      if (flash_read_word(address + j*2) != ptr[j])
+        verified = 0;
+#endif
+
+    ptr     += SPM_PAGESIZE/2;
+    address += SPM_PAGESIZE;
+  }
+
+  return verified;
+}
+
+static void flash_file(uint16_t sector) {
+  uint32_t address;
+  uint16_t sectors = (finfo.fsize - image_offset) / 512;
+#ifdef CRC_WHILE_FLASHING
+  uint8_t  resumed = (sector != 0);
+  uint16_t crc = 0xffff;
+#endif
+#ifdef CONFIG_VERIFY_FLASH
+  uint8_t  verified = 1;
+#endif
+
+  /* from here on the update has to be finished */
+  deadline_disarm();
 
   /* reopen file to reset offset */
   l_openfile(&fat, &finfo, &fd);
 
-  address = 0;
-  while (remain--) {
+  address = (uint32_t)sector * 512;
+#if defined(CONFIG_UPDATE_JOURNAL) || defined(CONFIG_BUNDLE)
+  /* skip the part that was flashed before the update was interrupted */
+  /* and the part of a bundle in front of the image                   */
+  if (sector || image_offset)
+    f_lseek(&fd, image_offset + address);
+#endif
+
+  for (; sector < sectors; sector++) {
+#ifdef CONFIG_VARIABLE_LENGTH
+    /* the tag sector ends up at the end of the application area */
+    if (sector == sectors-1)
+      address = BINARY_LENGTH - 512;
+#endif
 
     /* toggle green LED */
-    set_green_led(remain & 1);
+    set_green_led(sector & 1);
 
     /* read sector */
+#ifdef CRC_WHILE_FLASHING
+    if (l_read_crc(&fd, databuffer, &crc) != FR_OK)
+      break;
+#else
     if (f_read(&fd, databuffer, 512) != FR_OK)
       break;
+#endif
 
     /* flash sector */
-    ptr = (uint16_t *)databuffer;
+#ifdef CONFIG_VERIFY_FLASH
+    if (!flash_sector(address))
+      verified = 0;
+#else
+    flash_sector(address);
+#endif
+    address += 512;
 
-    for (i=0; i < 512 / SPM_PAGESIZE; i++) {
-      /* erase page */
-      boot_page_erase(address);
-      boot_spm_busy_wait();
+#ifdef CONFIG_UPDATE_JOURNAL
+    if ((sector+1) % JOURNAL_INTERVAL == 0)
+      journal_progress(sector+1);
+#endif
+  }
 
-      /* copy new contents */
-      for (j=0; j<SPM_PAGESIZE/2; j++)
-        boot_page_fill(address + j*2, *ptr++);
+  boot_rww_enable();
 
-      /* write page */
-      boot_page_write(address);
-      boot_spm_busy_wait();
+#ifdef CONFIG_SINGLE_PASS_UPDATE
+  /* the file was not checked before, try_start_app will refuse to */
+  /* start the result - remember this to limit the number of retries */
+  if (!resumed && (sector != sectors || crc != 0))
+    bad_passes++;
+#endif
 
-      address += SPM_PAGESIZE;
-    }
-  }
+#ifdef CONFIG_VERIFY_FLASH
+  /* the flash matches a complete file with a valid CRC */
+  app_verified = verified && !resumed && sector == sectors && crc == 0;
+#endif
 
-  boot_rww_enable();
+#ifdef CONFIG_UPDATE_JOURNAL
+  if (sector == sectors)
+    journal_close();
+#endif
+}
+
+/* read the last sector of the file and check its tag */
+static uint8_t read_tag(void) {
+  return img_read_tag(&fat, &finfo, &fd, databuffer, image_offset,
+                      BOOTLOADER_DEVID, BINARY_LENGTH, VARIABLE_LENGTH,
+                      &file_bi) == IMG_OK;
+}
+
+#ifdef CONFIG_SINGLE_PASS_UPDATE
+/* read the tag of the file, check its device ID and copy it to file_bi */
+/* The CRC is checked while flashing and by try_start_app.             */
+#  define check_file() read_tag()
+#else
+/* read the file, check its CRC and device ID and copy its tag to file_bi */
+static uint8_t check_file(void) {
+  return img_check_file(&fat, &finfo, &fd, databuffer, image_offset,
+                        BOOTLOADER_DEVID, BINARY_LENGTH, VARIABLE_LENGTH,
+                        &file_bi) == IMG_OK;
 }
+#endif
+
+/* check if the tag in file_bi should replace the application in flash */
+static imgresult_t accept_result(void) {
+  uint8_t retry = 0;
+
+#ifdef CONFIG_SINGLE_PASS_UPDATE
+  /* rewrite the same version if the last update did not work */
+  retry = app_corrupt && bad_passes < SINGLE_PASS_RETRIES;
+#endif
+
+  return img_accept(&file_bi, flash_tag_word(version), flash_tag_word(crc),
+                    retry);
+}
+
+#define accept_tag() (accept_result() == IMG_OK)
 
 static uint8_t validate_file(void) {
-  uint8_t  *ptr;
-  uint16_t i,crc;
-  uint16_t remain;
+  return check_file() && accept_tag();
+}
+
+#ifndef CONFIG_BUNDLE
+#  define bundle_candidate(s) 0
+#endif
+
+#ifdef CONFIG_CARD_PROBE
+/* A probe request is a file of one sector that starts with "NBPROBE" */
+#  define probe_candidate(s) ((s) == 512)
+
+/* measure the card if the file in finfo is a probe request */
+static void card_probe(void) {
+  card_probe_t result;
 
-  /* open file, can't fail */
   l_openfile(&fat, &finfo, &fd);
+  if (f_read(&fd, databuffer, 512) != FR_OK ||
+      memcmp(databuffer, "NBPROBE", 7))
+    return;
 
-  /* calculate CRC */
-  remain = BINARY_LENGTH/512;
-  crc = 0xffff;
-  while (remain) {
-    if (f_read(&fd, databuffer, 512) != FR_OK)
-      return 0;
+  /* the measurements must not be cut short */
+  deadline_disarm();
+
+  memset(&result, 0, sizeof(result));
+  result.magic   = CARD_PROBE_MAGIC;
+  result.size    = sizeof(result);
+  result.cpu_khz = F_CPU / 1000;
+
+  if (disk_probe(&fat.drive, &result) & STA_NOINIT)
+    result.cardtype = 0xff;
+
+  result.crc = crc_ccitt_block(0xffff, &result, offsetof(card_probe_t, crc));
+  eeprom_update_block(&result, (void *)EE_CARD_PROBE, sizeof(result));
+  eeprom_busy_wait();
+}
+#else
+#  define probe_candidate(s) 0
+#  define card_probe() do {} while (0)
+#endif
+
+#ifdef CONFIG_DELTA_UPDATE
+/* A delta file starts with a header sector that names the image it   */
+/* applies to and has a bit for every sector of the application area, */
+/* the contents of the sectors with a set bit follow in order. The    */
+/* last two bytes of the header sector are a CRC over the sector.     */
+#  define DELTA_MAGIC 0x5044424eUL   /* "NBDP" */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t device_id;
+  uint16_t base_crc;   /* tag CRC of the image the delta applies to */
+  uint16_t sectors;    /* sectors in the application area */
+  uint8_t  bitmap[];   /* changed sectors, LSB first */
+} delta_header_t;
 
-    remain--;
-    ptr = databuffer;
+#  define delta_candidate(s) ((s) < BINARY_LENGTH && (s) >= 1024 && ((s) & 511) == 0)
+
+static uint8_t delta_bitmap[(BINARY_LENGTH/512 + 7) / 8];
+
+static uint8_t delta_changed(uint16_t sector) {
+  return delta_bitmap[sector / 8] & (1 << (sector & 7));
+}
+
+/* apply the delta file in finfo to the application in flash */
+static uint8_t delta_update(void) {
+  delta_header_t *hdr = (delta_header_t *)databuffer;
+  uint16_t crc = 0xffff;
+  uint16_t sector;
+
+  l_openfile(&fat, &finfo, &fd);
 
-    for (i=0; i<512; i++)
-      crc = _crc_ccitt_update(crc, *ptr++);
+  if (l_read_crc(&fd, databuffer, &crc) != FR_OK ||
+      crc != 0 ||
+      hdr->magic     != DELTA_MAGIC ||
+      hdr->device_id != BOOTLOADER_DEVID ||
+      hdr->sectors   != BINARY_LENGTH/512 ||
+      hdr->base_crc  != flash_tag_word(crc))
+    return 0;
+
+  memcpy(delta_bitmap, hdr->bitmap, sizeof(delta_bitmap));
+
+  /* the tag of the new image must be part of the delta */
+  if (!delta_changed(BINARY_LENGTH/512 - 1))
+    return 0;
+
+  /* calculate the CRC of the merged image */
+  crc = 0xffff;
+  for (sector = 0; sector < BINARY_LENGTH/512; sector++) {
+    if (delta_changed(sector)) {
+      if (l_read_crc(&fd, databuffer, &crc) != FR_OK)
+        return 0;
+    } else {
+      crc = flash_crc(crc, (uint32_t)sector * 512, (uint32_t)sector * 512 + 512);
+    }
   }
 
   if (crc != 0)
     return 0;
 
-  /* copy bootinfo from buffer*/
-  memcpy(&file_bi, databuffer+512-sizeof(bootinfo_t), sizeof(bootinfo_t));
+  /* the tag sector was read last, the CRC above */
+  /* only covers full-length images               */
+  if (img_check_tag(databuffer, BINARY_LENGTH, BOOTLOADER_DEVID, BINARY_LENGTH,
+                    VARIABLE_LENGTH, &file_bi) != IMG_OK ||
+      !accept_tag())
+    return 0;
 
-  /* check bootinfo contents */
-  if (file_bi.device_id != BOOTLOADER_DEVID) {
+  /* write the changed sectors. The tag sector is written last, so */
+  /* after an interruption the delta still matches the flash and   */
+  /* can be applied again.                                         */
+  deadline_disarm();
+  l_openfile(&fat, &finfo, &fd);
+  if (f_lseek(&fd, 512) != FR_OK)
     return 0;
+
+  for (sector = 0; sector < BINARY_LENGTH/512; sector++) {
+    if (!delta_changed(sector))
+      continue;
+
+    set_green_led(sector & 1);
+
+    if (f_read(&fd, databuffer, 512) != FR_OK)
+      break;
+
+    flash_sector((uint32_t)sector * 512);
   }
 
-  /* dev mode */
-  if (file_bi.version == 0 &&
-      file_bi.crc != flash_read_word(BINARY_LENGTH - sizeof(bootinfo_t)
-                                     + offsetof(bootinfo_t, crc))) {
+  boot_rww_enable();
+  return 1;
+}
+#else
+#  define delta_candidate(s) 0
+#  define delta_update() 0
+#endif
+
+#ifdef CONFIG_UPDATE_JOURNAL
+/* continue an update that was interrupted */
+static uint8_t resume_update(void) {
+  journal_t journal;
+
+  if (!journal_read(&journal))
+    return 0;
+
+  finfo.clust = journal.clust;
+  finfo.fsize = journal.fsize;
+#ifdef CONFIG_BUNDLE
+  image_offset = (uint32_t)journal.offset * 512;
+#endif
+
+  /* the journal may refer to a different card */
+  if (finfo.fsize > image_offset &&
+      candidate_size(finfo.fsize - image_offset) &&
+      check_file() &&
+      file_bi.crc == journal.tag_crc) {
+    flash_file(journal.sectors);
     return 1;
   }
 
-  /* check version */
-  uint16_t flashversion = flash_read_word(BINARY_LENGTH - sizeof(bootinfo_t)
-                                          + offsetof(bootinfo_t, version));
+  journal_close();
+#ifdef CONFIG_BUNDLE
+  image_offset = 0;
+#endif
+  return 0;
+}
+#else
+#  define resume_update() 0
+#endif
+
+#ifdef CONFIG_UPDATE_MAILBOX
+/* flash the file named by the application in the mailbox */
+static uint8_t mailbox_update(void) {
+  update_mailbox_t mb;
+
+  eeprom_read_block(&mb, (void *)EE_UPDATE_MAILBOX, sizeof(mb));
+  if (mb.magic != MAILBOX_MAGIC)
+    return 0;
+
+  /* use the mailbox only once */
+  eeprom_write_word((uint16_t *)EE_UPDATE_MAILBOX, 0xffff);
+  eeprom_busy_wait();
+
+  if (mb.crc != crc_ccitt_block(0xffff, &mb, offsetof(update_mailbox_t, crc)) ||
+      !candidate_size(mb.fsize) ||
+      mb.csize == 0)
+    return 0;
+
+  /* set up the file system without mounting it */
+#ifdef EARLY_CARD_INIT
+  /* the card was initialized by try_update */
+  uint8_t drive = fat.drive;
+
+  memset(&fat, 0, sizeof(fat));
+  fat.drive = drive;
+#else
+  memset(&fat, 0, sizeof(fat));
+  if (disk_initialize(&fat.drive) & STA_NOINIT)
+    return 0;
+#endif
+
+  fat.fatbase   = mb.fatbase;
+  fat.database  = mb.database;
+  fat.max_clust = mb.max_clust;
+  fat.csize     = mb.csize;
+  fat.fs_type   = mb.fs_type;
+
+  finfo.clust = mb.clust;
+  finfo.fsize = mb.fsize;
+
+  /* the tag check makes sure the card was not changed */
+  if (!validate_file() || file_bi.crc != mb.tag_crc)
+    return 0;
+
+#ifdef CONFIG_UPDATE_JOURNAL
+  /* the journal writes must not be cut short either */
+  deadline_disarm();
+  journal_open(finfo.clust, finfo.fsize, image_offset / 512, file_bi.crc);
+#endif
+  flash_file(0);
+  return 1;
+}
+#else
+#  define mailbox_update() 0
+#endif
+
+#ifdef CONFIG_RAW_PARTITION
+/* flash the image in a raw firmware partition, returns 1 if the */
+/* partition holds a valid image, even if it is already in flash */
+static uint8_t raw_update(img_select_t *sel) {
+  imgresult_t res = img_check_raw(sel);
+
+  /* an interrupted update is simply repeated from the start */
+  if (res == IMG_OK)
+    flash_file(0);
+
+  return res == IMG_OK || res == IMG_SAME || res == IMG_OLDER;
+}
+#endif
 
-  if (flashversion == 0xffff ||
-      file_bi.version > flashversion) {
+#ifdef CONFIG_DIR_HINT
+/* start the fingerprint with the geometry of the mounted file system, */
+/* sects_fat up to database                                            */
+static void hint_start(void) {
+  hint_volume = crc_ccitt_block(0xffff, &fat.sects_fat,
+                                offsetof(FATFS, database) + sizeof(DWORD)
+                                - offsetof(FATFS, sects_fat));
+}
+
+/* add the entry in finfo to the fingerprint. Any file that is added, */
+/* removed or rewritten to a new size or location changes it.         */
+static void hint_entry(void) {
+  hint_volume = crc_ccitt_block(hint_volume, &finfo, offsetof(FILINFO, fname));
+  hint_size   = finfo.fsize;
+}
+
+/* describe the directory entry at hint_pos and the tag in file_bi */
+static void hint_fill(dir_hint_t *hint) {
+  hint->sect       = hint_pos.sect;
+  hint->clust      = hint_pos.clust;
+  hint->index      = hint_pos.index;
+  hint->file_clust = finfo.clust;
+  hint->fsize      = hint_size;
+  hint->tag_crc    = file_bi.crc;
+}
+
+/* remember the current entry if its tag is the one in the chip */
+static void hint_note_chip(void) {
+  if (file_bi.device_id == BOOTLOADER_DEVID &&
+      file_bi.crc == flash_tag_word(crc)) {
+    hint_fill(&hint_chip);
+    hint_chip_found = 1;
+  }
+}
+
+/* store a hint, only valid after the complete directory was read */
+static void hint_save(dir_hint_t *hint) {
+  hint->volume = hint_volume;
+  hint->crc    = crc_ccitt_block(0xffff, hint, offsetof(dir_hint_t, crc));
+
+  eeprom_update_block(hint, (void *)EE_DIR_HINT, sizeof(dir_hint_t));
+  eeprom_busy_wait();
+}
+
+/* check if the directory is unchanged since the file in the */
+/* chip was seen and the file is still in the same place      */
+static uint8_t hint_check(void) {
+  dir_hint_t hint;
+
+  /* fall back to a full search if the application turns out corrupt */
+  if (hint_tried)
+    return 0;
+  hint_tried = 1;
+
+  eeprom_read_block(&hint, (void *)EE_DIR_HINT, sizeof(hint));
+  if (hint.crc != crc_ccitt_block(0xffff, &hint, offsetof(dir_hint_t, crc)))
+    return 0;
+
+  /* only the directory is read, not the files in it */
+  hint_start();
+  l_openroot(&fat, &dh);
+  while (f_readdir(&dh, &finfo) == FR_OK && finfo.fname[0] != 0)
+    hint_entry();
+
+  if (hint.volume != hint_volume)
+    return 0;
+
+  dh.fs    = &fat;
+  dh.sect  = hint.sect;
+  dh.clust = hint.clust;
+  dh.index = hint.index;
+
+  if (f_readdir(&dh, &finfo) != FR_OK ||
+      finfo.clust != hint.file_clust ||
+      finfo.fsize != hint.fsize)
+    return 0;
+
+#  ifdef CONFIG_BUNDLE
+  image_offset = 0;
+  if (bundle_candidate(finfo.fsize) &&
+      img_read_bundle(&fat, &finfo, &fd, databuffer, BOOTLOADER_DEVID,
+                      BINARY_LENGTH, VARIABLE_LENGTH, &image_offset,
+                      &file_bi) != IMG_OK)
+    return 0;
+#  endif
+
+  /* the file may have been overwritten in place */
+  return read_tag() &&
+    file_bi.crc == hint.tag_crc &&
+    flash_tag_word(crc) == hint.tag_crc;
+}
+#else
+#  define hint_check() 0
+#endif
+
+#ifdef EARLY_CARD_INIT
+/* initialize the card and store its type in fat.drive */
+static uint8_t init_card(void) {
+#  ifdef CONFIG_WARM_START
+  warm_start_t *ws = BOOT_WARM_START;
+
+  /* the card is still set up if the application reset */
+  /* the chip right after leaving the handshake        */
+  if ((reset_flags & _BV(WDRF)) &&
+      ws->magic == WARM_START_MAGIC &&
+      ws->cardtype == (uint8_t)~ws->check &&
+      disk_resume(ws->cardtype) == 0) {
+    fat.drive = ws->cardtype;
+    ws->magic = 0;
     return 1;
   }
 
+  /* use the handshake only once */
+  ws->magic = 0;
+#  endif
+
+#  ifdef CONFIG_BACKGROUND_CRC
+  /* check the application while the card powers up */
+  return !(disk_initialize_poll(&fat.drive, app_crc_step) & STA_NOINIT);
+#  else
+  return !(disk_initialize(&fat.drive) & STA_NOINIT);
+#  endif
+}
+#endif
+
+/* called by img_select for every directory entry */
+static uint8_t select_entry(img_select_t *sel) {
+#ifdef CONFIG_DIR_HINT
+  hint_entry();
+#endif
+
+  /* give up on a search that takes too long */
+  if (deadline_expired())
+    return 1;
+
+  /* small files may be deltas to the current application. If one was */
+  /* applied, the files found so far were compared with the old flash  */
+  if (delta_candidate(finfo.fsize) && delta_update())
+    return 1;
+
+  if (probe_candidate(finfo.fsize))
+    card_probe();
+
   return 0;
 }
 
+static imgresult_t select_accept(img_select_t *sel) {
+  return accept_result();
+}
+
+#ifdef CONFIG_DIR_HINT
+/* track the position of the best file and of the one in the chip */
+static void select_result(img_select_t *sel, imgresult_t res) {
+  if (res == IMG_OK)
+    hint_fill(&hint_best);
+  else
+    hint_note_chip();
+}
+#endif
+
+/* set up a search with the objects and settings of the boot loader */
+static void select_init(img_select_t *sel) {
+  sel->fs          = &fat;
+  sel->dir         = &dh;
+  sel->fi          = &finfo;
+  sel->fp          = &fd;
+  sel->buf         = databuffer;
+  sel->bi          = &file_bi;
+  sel->devid       = BOOTLOADER_DEVID;
+  sel->length      = BINARY_LENGTH;
+  sel->varlen      = VARIABLE_LENGTH;
+  sel->single_pass = SINGLE_PASS;
+  sel->bundles     = BUNDLES;
+  sel->entry       = select_entry;
+  sel->accept      = select_accept;
+#ifdef CONFIG_DIR_HINT
+  sel->pos         = &hint_pos;
+  sel->result      = select_result;
+#else
+  sel->pos         = NULL;
+  sel->result      = NULL;
+#endif
+}
+
 static void try_update(void) {
+  img_select_t sel;
+#ifdef CONFIG_DIR_HINT
+  uint8_t      complete;
+#endif
+
   set_green_led(1);
 
+#ifdef CONFIG_CARD_HANDOFF
+  card_mounted = 0;
+#endif
+#ifdef CONFIG_BUNDLE
+  image_offset = 0;
+#endif
+
+#ifdef EARLY_CARD_INIT
+  if (!init_card()) {
+    set_green_led(0);
+    return;
+  }
+#endif
+
+  if (mailbox_update()) {
+    set_green_led(0);
+    return;
+  }
+
+  select_init(&sel);
+
   /* mount file system */
-  fr = f_mount(0, &fat);
+#ifdef CONFIG_RAW_PARTITION
+  fr = f_mount(MOUNT_RAW | MOUNT_FLAGS, &fat);
+  if (fr == FR_OK && fat.fs_type == FS_RAW) {
+    if (raw_update(&sel)) {
+#ifdef CONFIG_CARD_HANDOFF
+      card_mounted = 1;
+#endif
+      set_green_led(0);
+      return;
+    }
+
+    /* fall back to the FAT file system */
+    fr = f_mount(MOUNT_FLAGS, &fat);
+  }
+#else
+  fr = f_mount(MOUNT_FLAGS, &fat);
+#endif
   if (fr != FR_OK) {
     set_green_led(0);
     return;
   }
 
-  l_openroot(&fat, &dh);
+#ifdef CONFIG_CARD_HANDOFF
+  card_mounted = 1;
+#endif
 
-  while ((f_readdir(&dh, &finfo) == FR_OK) && finfo.fname[0] != 0) {
-    if (finfo.fsize == BINARY_LENGTH) {
-      /* candidate file found - validate and flash if valid */
-      if (validate_file()) {
-        flash_file();
-        break;
-      }
-    }
+  /* start the application if the card took too long */
+  if (deadline_expired()) {
+    set_green_led(0);
+    return;
+  }
+
+  if (resume_update()) {
+    set_green_led(0);
+    return;
+  }
+
+  /* the file in the chip is still where it was last time */
+  if (hint_check()) {
+    set_green_led(0);
+    return;
+  }
+
+  /* the same search as cardaudit, see imagecheck.h */
+#ifdef CONFIG_DIR_HINT
+  hint_start();
+  hint_chip_found = 0;
+  complete = img_select(&sel);
+#else
+  img_select(&sel);
+#endif
+
+  /* flash only the best file, so a card with several */
+  /* versions is never flashed more than once          */
+  if (sel.found) {
+    memcpy(&finfo, &sel.best, sizeof(FILINFO));
+    file_bi = sel.best_bi;
+#ifdef CONFIG_BUNDLE
+    image_offset = sel.best_offset;
+#endif
+#ifdef CONFIG_UPDATE_JOURNAL
+    /* the journal writes must not be cut short either */
+    deadline_disarm();
+    journal_open(finfo.clust, finfo.fsize, image_offset / 512, file_bi.crc);
+#endif
+    flash_file(0);
+#ifdef CONFIG_DIR_HINT
+    /* the fingerprint needs the complete directory */
+    if (complete)
+      hint_save(&hint_best);
+  } else if (complete && hint_chip_found) {
+    hint_save(&hint_chip);
+#endif
   }
 
   set_green_led(0);
 }
 
+#ifdef CONFIG_SD_TRACE
+#  ifdef CONFIG_SD_TRACE_BAUD
+#    ifndef UDR0
+#      error "CONFIG_SD_TRACE_BAUD needs a chip with USART0"
+#    endif
+#    define TRACE_DUMP_ENTRIES SD_TRACE_ENTRIES
+
+static void trace_putc(uint8_t c) {
+  loop_until_bit_is_set(UCSR0A, UDRE0);
+  UDR0 = c;
+}
+
+static void trace_puthex(uint8_t n) {
+  n &= 15;
+  trace_putc(n < 10 ? '0' + n : 'a' - 10 + n);
+}
+#  else
+#    define TRACE_DUMP_ENTRIES SD_TRACE_EE_ENTRIES
+
+static uint8_t *trace_addr;
+#  endif
+
+static uint16_t trace_crc;
+
+/* append data to the written trace */
+static void trace_write(const void *data, uint8_t len) {
+  trace_crc = crc_ccitt_block(trace_crc, data, len);
+
+#  ifdef CONFIG_SD_TRACE_BAUD
+  const uint8_t *ptr = data;
+
+  while (len--) {
+    trace_puthex(*ptr >> 4);
+    trace_puthex(*ptr++);
+  }
+#  else
+  eeprom_update_block(data, trace_addr, len);
+  trace_addr += len;
+#  endif
+}
+
+/* write the newest commands of the trace to the USART or, if an */
+/* application asked for it, to the EEPROM                       */
+static void trace_dump(void) {
+  sd_trace_dump_t head;
+  uint16_t crc;
+  uint8_t  i;
+
+#  ifdef CONFIG_SD_TRACE_BAUD
+  /* one line "NBTRACE <hex bytes>", see sdreplay */
+  const char *tag = "NBTRACE ";
+
+  UBRR0H = ((F_CPU / 4 / CONFIG_SD_TRACE_BAUD - 1) / 2) >> 8;
+  UBRR0L = ((F_CPU / 4 / CONFIG_SD_TRACE_BAUD - 1) / 2) & 0xff;
+  UCSR0A = _BV(U2X0) | _BV(TXC0);
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+  UCSR0B = _BV(TXEN0);
+
+  while (*tag)
+    trace_putc(*tag++);
+#  else
+  uint8_t *request = (uint8_t *)EE_TRACE_REQUEST;
+
+  /* the EEPROM is only written when requested */
+  if (eeprom_read_byte(request) != TRACE_REQUEST_MAGIC)
+    return;
+
+  trace_addr = (uint8_t *)EE_SD_TRACE;
+#  endif
+
+  head.magic    = SD_TRACE_MAGIC;
+  head.cpu_khz  = F_CPU / 1000;
+  head.count    = sd_trace.count;
+  head.entries  = sd_trace.count < TRACE_DUMP_ENTRIES ? sd_trace.count : TRACE_DUMP_ENTRIES;
+  head.cardtype = sd_trace.cardtype;
+
+  trace_crc = 0xffff;
+  trace_write(&head, sizeof(head));
+
+  /* oldest first */
+  i = (sd_trace.next + SD_TRACE_ENTRIES - head.entries) % SD_TRACE_ENTRIES;
+  while (head.entries--) {
+    trace_write(&sd_trace.entry[i], sizeof(sd_trace_entry_t));
+    if (++i == SD_TRACE_ENTRIES)
+      i = 0;
+  }
+  crc = trace_crc;
+  trace_write(&crc, 2);
+
+#  ifdef CONFIG_SD_TRACE_BAUD
+  trace_putc('\r');
+  trace_putc('\n');
+
+  /* let the last byte leave before the USART is switched off */
+  loop_until_bit_is_set(UCSR0A, TXC0);
+  UCSR0B = 0;
+  UCSR0A = 0;
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+  UBRR0H = 0;
+  UBRR0L = 0;
+#  else
+  eeprom_update_byte(request, 0xff);
+  eeprom_busy_wait();
+#  endif
+}
+
+static void trace_start(void) {
+  memset(&sd_trace, 0, sizeof(sd_trace_t));
+  sd_trace.magic = SD_TRACE_MAGIC;
+}
+#endif
+
 static void __attribute__((noreturn)) (*start_app)(void) = 0;
 
+#ifdef CONFIG_CARD_HANDOFF
+/* the handoff must end below .data, see the Makefile */
+typedef char handoff_fits_boot_ram[sizeof(warm_start_t) + sizeof(boot_handoff_t) <= BOOT_RAM_SIZE ? 1 : -1];
+
+/* describe the card for the application or invalidate the handoff */
+static void handoff_write(void) {
+  boot_handoff_t *h = BOOT_HANDOFF;
+
+  if (!card_mounted) {
+    h->magic = 0;
+    return;
+  }
+
+  memset(h, 0, sizeof(boot_handoff_t));
+  h->magic    = HANDOFF_MAGIC;
+  h->version  = HANDOFF_VERSION;
+  h->size     = sizeof(boot_handoff_t);
+  h->flags    = HANDOFF_SPI_LIVE;
+  h->cardtype = fat.drive;
+  h->spcr     = SPCR;
+  h->spsr     = SPSR;
+
+  if (disk_ioctl(fat.drive, MMC_GET_CID, h->cid) == RES_OK)
+    h->flags |= HANDOFF_CID;
+
+  if (fat.fs_type != FS_RAW) {
+    h->flags    |= HANDOFF_MOUNTED;
+    h->fatbase   = fat.fatbase;
+    h->dirbase   = fat.dirbase;
+    h->database  = fat.database;
+    h->max_clust = fat.max_clust;
+    h->sects_fat = fat.sects_fat;
+    h->n_rootdir = fat.n_rootdir;
+    h->csize     = fat.csize;
+    h->fs_type   = fat.fs_type;
+    h->n_fats    = fat.n_fats;
+  }
+
+  h->crc = crc_ccitt_block(0xffff, h, offsetof(boot_handoff_t, crc));
+}
+#endif
+
 static void try_start_app(void) {
-  uint16_t crc = 0xffff;
-  uint16_t addr;
+  uint16_t crc;
 
   /* check in-flash CRC */
-#if BINARY_LENGTH < 64*1024
-  for (addr=0; addr<BINARY_LENGTH; addr++)
-    crc = _crc_ccitt_update(crc, pgm_read_byte(addr));
-#elif BINARY_LENGTH < 128*1024
-  /* slightly smaller and faster than a 32 bit loop counter */
-  addr = 0;
-  do {
-    crc = _crc_ccitt_update(crc, pgm_read_byte(addr));
-  } while (++addr != 0);
-
-  for (addr=0; addr < BINARY_LENGTH - 65536; addr++)
-    crc = _crc_ccitt_update(crc, pgm_read_byte_far(65536UL + addr));
-#else
-#  error FIXME: Devices larger than 128K not supported yet
+#ifdef CONFIG_VERIFY_FLASH
+  /* unless flash_file just compared it with a file with a valid CRC */
+  if (app_verified)
+    crc = 0;
+  else
+#endif
+#ifdef CONFIG_BOOT_DEADLINE
+  /* or deadline_expired checked it before abandoning the search */
+  if (deadline_app_valid)
+    crc = 0;
+  else
 #endif
+    crc = app_crc();
 
   if (crc == 0) {
     /* deinitialize hardware */
     leds_deinit();
-    SPCR     = 0;
-    SPSR     = 0;
-    SPI_PORT = 0;
-    SPI_DDR  = 0;
+#ifdef CONFIG_CARD_HANDOFF
+    /* a card that was handed off keeps its SPI settings */
+    handoff_write();
+    if (!card_mounted)
+#endif
+    {
+      SPCR     = 0;
+      SPSR     = 0;
+      SPI_PORT = 0;
+      SPI_DDR  = 0;
+    }
+#ifdef HAVE_SD_DETECT
+    sdcard_interface_deinit();
+#endif
+#if defined(CONFIG_BOOT_DEADLINE) || defined(CONFIG_SD_TRACE)
+    TCCR1B = 0;
+    TCNT1  = 0;
+    OCR1A  = 0;
+    TIFR1  = _BV(OCF1A) | _BV(TOV1);
+#endif
 
     /* start app */
     start_app();
   } else {
+#ifdef CONFIG_SINGLE_PASS_UPDATE
+    app_corrupt = 1;
+#endif
     /* blink red LED for two seconds if application is corrupted */
     for (uint8_t i=0; i<10;i++) {
       set_red_led(0);
@@ -238,11 +1305,97 @@ static void try_start_app(void) {
   }
 }
 
+#ifdef CONFIG_UPDATE_GATE
+/* check if the card should be searched before starting the application */
+static uint8_t update_gate(void) {
+  uint8_t *request = (uint8_t *)EE_UPDATE_REQUEST;
+
+  if (eeprom_read_byte(request) == UPDATE_REQUEST_MAGIC) {
+    eeprom_write_byte(request, 0xff);
+    eeprom_busy_wait();
+    return 1;
+  }
+
+#  ifdef HAVE_UPDATE_BUTTON
+  if (update_button_pressed())
+    return 1;
+#  endif
+
+#  ifdef CONFIG_UPDATE_MAILBOX
+  if (eeprom_read_word((uint16_t *)EE_UPDATE_MAILBOX) == MAILBOX_MAGIC)
+    return 1;
+#  endif
+
+  return 0;
+}
+#else
+#  define update_gate() 1
+#endif
+
+#ifdef HAVE_SD_DETECT
+#  ifdef GICR
+#    define IVSEL_REG GICR
+#  else
+#    define IVSEL_REG MCUCR
+#  endif
+
+/* the pin change only needs to end the sleep */
+EMPTY_INTERRUPT(SDCARD_CHANGE_VECT);
+
+/* move the interrupt vectors to the boot section (1) or back to the */
+/* application (0), IVSEL must follow IVCE within four cycles         */
+static void select_vectors(uint8_t boot) {
+  uint8_t val = IVSEL_REG & ~(_BV(IVCE) | _BV(IVSEL));
+
+  asm volatile("out %0, %1\n"
+               "out %0, %2\n"
+               :
+               : "I" (_SFR_IO_ADDR(IVSEL_REG)),
+                 "r" (val | _BV(IVCE)),
+                 "r" (boot ? val | _BV(IVSEL) : val)
+               );
+}
+
+/* sleep until a card is inserted */
+static void wait_for_card(void) {
+  set_red_led(0);
+
+  /* a pin change only wakes the chip with the I bit set, so the vectors */
+  /* of the corrupt application must not be active while sleeping       */
+  select_vectors(1);
+  sdcard_change_irq(1);
+
+  if (!sdcard_detect()) {
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    sleep_enable();
+    /* the instruction after sei is executed before any interrupt, */
+    /* so a change after the check above still ends the sleep      */
+    sei();
+    sleep_cpu();
+    cli();
+    sleep_disable();
+  }
+
+  sdcard_change_irq(0);
+  select_vectors(0);
+  set_red_led(1);
+
+  /* let the contacts settle */
+  _delay_ms(50);
+}
+#endif
+
 /* Make sure the watchdog is disabled as soon as possible */
 void disable_watchdog(void) \
       __attribute__((naked)) \
       __attribute__((section(".init3")));
 void disable_watchdog(void) {
+#if defined(CONFIG_WARM_START) || defined(CONFIG_BOOT_DEADLINE) || \
+    defined(CONFIG_SD_TRACE)
+  reset_flags = MCUSR;
+  /* WDRF keeps the watchdog enabled */
+  MCUSR = 0;
+#endif
   wdt_disable();
 }
 
@@ -270,9 +1423,57 @@ int main(void) {
   set_red_led(1);
   set_green_led(0);
 
+#ifdef HAVE_SD_DETECT
+  sdcard_interface_init();
+#endif
+
+#ifdef CONFIG_SD_TRACE
+  /* the trace of a search that the watchdog ended is still in RAM */
+  if ((reset_flags & _BV(WDRF)) && sd_trace.magic == SD_TRACE_MAGIC &&
+      sd_trace.next < SD_TRACE_ENTRIES)
+    trace_dump();
+  trace_start();
+#endif
+
+  /* the card is always searched if the application is not valid */
+  uint8_t scan = update_gate();
+
+#ifdef CONFIG_BOOT_DEADLINE
+  /* the application comes first after a search that hung */
+  if (deadline_reset())
+    scan = 0;
+  else if (scan)
+    deadline_arm();
+#endif
+
   while (1) {
-    try_update();
+#ifdef HAVE_SD_DETECT
+    /* no card, no need to initialize it */
+    if (scan && sdcard_detect())
+      try_update();
+#else
+    if (scan)
+      try_update();
+#endif
+
+    /* the search is over, later ones only happen without */
+    /* a valid application and have no deadline           */
+    deadline_disarm();
+#ifdef CONFIG_SD_TRACE
+    if (sd_trace.count) {
+      sd_trace.cardtype = fat.drive;
+      trace_dump();
+      trace_start();
+    }
+#endif
     try_start_app();
+    scan = 1;
+
+#ifdef HAVE_SD_DETECT
+    /* the application is not valid, wait for a card with an update */
+    if (!sdcard_detect())
+      wait_for_card();
+#endif
 //     set_red_led(0);
 //      _delay_ms(100);
 //      set_red_led(1);
@@ -0,0 +1,550 @@
+/* mkcard - card image builder for newboot
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+
+   mkcard.c: Writes a FAT file system optimized for the boot loader
+
+   The firmware becomes the first entry of the root directory and is
+   stored in consecutive clusters starting at the first data cluster.
+   The cluster size is the largest that is valid for the FAT type, so
+   the boot loader needs as few FAT lookups as possible, and the data
+   area is aligned to the cluster size.
+
+*/
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef _WIN32
+#  define fseeko _fseeki64
+#  define ftello _ftelli64
+#endif
+
+#define SECTOR      512
+#define PART_START  8192      /* 4 MiB, erase block aligned on SD cards */
+#define RAW_START   2048      /* raw firmware partition, 1 MiB */
+#define RAW_TYPE    0xda      /* RAW_PARTITION_TYPE in ff.h */
+#define RAW_MAX     255       /* sectors */
+#define MAX_FILES   (SECTOR / 32)
+
+#define FAT16_MIN_CLUSTERS 4085
+#define FAT16_MAX_CLUSTERS 65524
+#define FAT32_MIN_CLUSTERS 65525
+
+/* geometry of the file system */
+struct layout {
+  int      fat32;
+  uint32_t csize;      /* sectors per cluster */
+  uint32_t reserved;   /* reserved sectors */
+  uint32_t fatsize;    /* sectors per FAT */
+  uint32_t rootsects;  /* root directory sectors (FAT16) */
+  uint32_t total;      /* sectors in the partition */
+  uint32_t clusters;   /* number of data clusters */
+  uint32_t database;   /* first data sector, relative to the partition */
+};
+
+struct file {
+  const char *path;
+  uint8_t     name[11];
+  uint32_t    size;
+  uint32_t    clust;
+};
+
+static FILE *out;
+static int   raw;       /* also write the firmware to a raw partition */
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+static int write_sectors(uint64_t lba, const void *buf, uint32_t count) {
+  if (fseeko(out, lba * SECTOR, SEEK_SET) ||
+      fwrite(buf, SECTOR, count, out) != count) {
+    perror("write");
+    return 1;
+  }
+  return 0;
+}
+
+/* parse a size with an optional K, M or G suffix */
+static int parse_size(const char *str, uint64_t *size) {
+  char *end;
+  unsigned long long v;
+
+  errno = 0;
+  v = strtoull(str, &end, 0);
+  if (errno || end == str || *str == '-')
+    return 1;
+
+  switch (toupper((unsigned char)*end)) {
+  case 'G': v <<= 10; /* fall through */
+  case 'M': v <<= 10; /* fall through */
+  case 'K': v <<= 10; end++; break;
+  case 0:   break;
+  default:  return 1;
+  }
+
+  if (*end || v > 0xffffffffULL * SECTOR)
+    return 1;
+
+  *size = v;
+  return 0;
+}
+
+/* convert the file name of a path to a 8.3 directory entry name */
+static void make_name(uint8_t *name, const char *path) {
+  const char *base = path, *p;
+  int i = 0;
+
+  for (p = path; *p; p++)
+    if (*p == '/' || *p == '\\')
+      base = p + 1;
+
+  memset(name, ' ', 11);
+  for (p = base; *p && *p != '.' && i < 8; p++)
+    name[i++] = *p;
+
+  p = strrchr(base, '.');
+  if (p && p != base)
+    for (i = 8, p++; *p && i < 11; p++)
+      name[i++] = *p;
+
+  for (i = 0; i < 11; i++) {
+    name[i] = toupper(name[i]);
+    if (name[i] < 0x20 || name[i] > 0x7e || strchr("\"*+,./:;<=>?[\\]|", name[i]))
+      name[i] = '_';
+  }
+}
+
+/* calculate the geometry for a cluster size, 0 if it is not valid */
+static int try_layout(struct layout *l, int fat32, uint32_t csize, uint32_t total) {
+  uint64_t tmp1, tmp2;
+
+  l->fat32     = fat32;
+  l->csize     = csize;
+  l->total     = total;
+  l->rootsects = fat32 ? 0 : 32;   /* 512 entries */
+  l->reserved  = fat32 ? 32 : 1;
+
+  if (total <= l->reserved + l->rootsects)
+    return 0;
+
+  /* FAT size as recommended by Microsoft's FAT specification */
+  tmp1 = total - (l->reserved + l->rootsects);
+  tmp2 = 256 * csize + 2;
+  if (fat32)
+    tmp2 /= 2;
+  l->fatsize = (tmp1 + tmp2 - 1) / tmp2;
+
+  /* align the data area to the cluster size */
+  l->database = l->reserved + 2 * l->fatsize + l->rootsects;
+  if ((PART_START + l->database) % csize) {
+    uint32_t pad = csize - (PART_START + l->database) % csize;
+
+    l->reserved += pad;
+    l->database += pad;
+  }
+
+  if (l->database >= total)
+    return 0;
+
+  l->clusters = (total - l->database) / csize;
+
+  if (fat32)
+    return l->clusters >= FAT32_MIN_CLUSTERS;
+  else
+    return l->clusters >= FAT16_MIN_CLUSTERS && l->clusters <= FAT16_MAX_CLUSTERS;
+}
+
+/* find the largest valid cluster size */
+static int choose_layout(struct layout *l, int fattype, uint32_t total) {
+  uint32_t csize;
+
+  if (fattype != 32)
+    for (csize = 64; csize >= 1; csize /= 2)
+      if (try_layout(l, 0, csize, total))
+        return 0;
+
+  if (fattype != 16)
+    for (csize = 64; csize >= 1; csize /= 2)
+      if (try_layout(l, 1, csize, total))
+        return 0;
+
+  return 1;
+}
+
+static int write_filesystem(const struct layout *l, struct file *files, int nfiles) {
+  uint8_t  *buf;
+  uint32_t  i, sect, clust, fat_sects;
+  uint64_t  part = PART_START;
+  uint32_t  volid = time(NULL);
+  time_t    now = time(NULL);
+  struct tm *tm = localtime(&now);
+  uint16_t  fdate = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+  uint16_t  ftime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+  int       f;
+
+  buf = calloc(l->csize, SECTOR);
+  if (!buf) {
+    perror("calloc");
+    return 1;
+  }
+
+  /* allocate the files in consecutive clusters */
+  clust = l->fat32 ? 3 : 2;
+  for (f = 0; f < nfiles; f++) {
+    files[f].clust = files[f].size ? clust : 0;
+    clust += (files[f].size + l->csize * SECTOR - 1) / (l->csize * SECTOR);
+  }
+  if (clust - 2 > l->clusters) {
+    fprintf(stderr, "Files do not fit on the card\n");
+    return 1;
+  }
+
+  /* MBR, the FAT partition follows the raw partition if there is one */
+  memset(buf, 0, SECTOR);
+  for (i = 0; i < (raw ? 2 : 1); i++) {
+    uint8_t *pe = buf + 446 + 16*i;
+
+    pe[0] = 0x00;
+    pe[1] = 0xfe;                               /* CHS unused, LBA only */
+    pe[2] = 0xff;
+    pe[3] = 0xff;
+    pe[4] = l->fat32 ? 0x0c : 0x0e;             /* FAT32 LBA / FAT16 LBA */
+    pe[5] = 0xfe;
+    pe[6] = 0xff;
+    pe[7] = 0xff;
+    put32(pe +  8, PART_START);
+    put32(pe + 12, l->total);
+  }
+  if (raw) {
+    buf[446 + 4] = RAW_TYPE;
+    put32(buf + 446 +  8, RAW_START);
+    put32(buf + 446 + 12, (files[0].size + SECTOR - 1) / SECTOR);
+  }
+  buf[510] = 0x55;
+  buf[511] = 0xaa;
+  if (write_sectors(0, buf, 1))
+    return 1;
+
+  /* boot sector */
+  memset(buf, 0, SECTOR);
+  memcpy(buf, "\xeb\x58\x90" "NEWBOOT ", 11);
+  put16(buf + 11, SECTOR);
+  buf[13] = l->csize;
+  put16(buf + 14, l->reserved);
+  buf[16] = 2;                                  /* number of FATs */
+  put16(buf + 17, l->fat32 ? 0 : l->rootsects * SECTOR / 32);
+  if (!l->fat32 && l->total < 65536)
+    put16(buf + 19, l->total);
+  else
+    put32(buf + 32, l->total);
+  buf[21] = 0xf8;                               /* media */
+  put16(buf + 24, 63);                          /* sectors per track */
+  put16(buf + 26, 255);                         /* heads */
+  put32(buf + 28, PART_START);                  /* hidden sectors */
+
+  if (l->fat32) {
+    put32(buf + 36, l->fatsize);
+    put32(buf + 44, 2);                         /* root directory cluster */
+    put16(buf + 48, 1);                         /* FSInfo sector */
+    put16(buf + 50, 6);                         /* backup boot sector */
+    buf[64] = 0x80;
+    buf[66] = 0x29;
+    put32(buf + 67, volid);
+    memcpy(buf + 71, "NO NAME    FAT32   ", 19);
+  } else {
+    put16(buf + 22, l->fatsize);
+    buf[36] = 0x80;
+    buf[38] = 0x29;
+    put32(buf + 39, volid);
+    memcpy(buf + 43, "NO NAME    FAT16   ", 19);
+  }
+  buf[510] = 0x55;
+  buf[511] = 0xaa;
+  if (write_sectors(part, buf, 1))
+    return 1;
+  if (l->fat32 && write_sectors(part + 6, buf, 1))
+    return 1;
+
+  /* FSInfo */
+  if (l->fat32) {
+    memset(buf, 0, SECTOR);
+    put32(buf +   0, 0x41615252);
+    put32(buf + 484, 0x61417272);
+    put32(buf + 488, l->clusters - (clust - 2));
+    put32(buf + 492, clust);
+    put32(buf + 508, 0xaa550000);
+    if (write_sectors(part + 1, buf, 1) ||
+        write_sectors(part + 7, buf, 1))
+      return 1;
+  }
+
+  /* FATs: sector by sector, both copies */
+  fat_sects = l->fatsize;
+  for (sect = 0; sect < fat_sects; sect++) {
+    uint32_t per = l->fat32 ? SECTOR / 4 : SECTOR / 2;
+    uint32_t c;
+
+    memset(buf, 0, SECTOR);
+    for (i = 0; i < per; i++) {
+      uint32_t val = 0;
+
+      c = sect * per + i;
+      if (c == 0)
+        val = l->fat32 ? 0x0ffffff8 : 0xfff8;
+      else if (c == 1 || (l->fat32 && c == 2))
+        val = l->fat32 ? 0x0fffffff : 0xffff;
+      else
+        for (f = 0; f < nfiles; f++) {
+          uint32_t n = (files[f].size + l->csize * SECTOR - 1) / (l->csize * SECTOR);
+
+          if (files[f].clust && c >= files[f].clust && c < files[f].clust + n) {
+            val = (c == files[f].clust + n - 1) ?
+              (l->fat32 ? 0x0fffffff : 0xffff) : c + 1;
+            break;
+          }
+        }
+
+      if (l->fat32)
+        put32(buf + 4*i, val);
+      else
+        put16(buf + 2*i, val);
+    }
+
+    if (write_sectors(part + l->reserved + sect, buf, 1) ||
+        write_sectors(part + l->reserved + l->fatsize + sect, buf, 1))
+      return 1;
+  }
+
+  /* root directory, the firmware is the first entry */
+  memset(buf, 0, l->csize * SECTOR);
+  for (f = 0; f < nfiles; f++) {
+    uint8_t *de = buf + 32*f;
+
+    memcpy(de, files[f].name, 11);
+    de[11] = 0x20;                              /* archive */
+    put16(de + 14, ftime);
+    put16(de + 16, fdate);
+    put16(de + 18, fdate);
+    put16(de + 20, files[f].clust >> 16);
+    put16(de + 22, ftime);
+    put16(de + 24, fdate);
+    put16(de + 26, files[f].clust);
+    put32(de + 28, files[f].size);
+  }
+  if (l->fat32) {
+    if (write_sectors(part + l->database, buf, l->csize))
+      return 1;
+  } else {
+    if (write_sectors(part + l->database - l->rootsects, buf, 1))
+      return 1;
+    memset(buf, 0, SECTOR);
+    for (sect = 1; sect < l->rootsects; sect++)
+      if (write_sectors(part + l->database - l->rootsects + sect, buf, 1))
+        return 1;
+  }
+
+  /* file contents */
+  for (f = 0; f < nfiles; f++) {
+    FILE    *in;
+    uint32_t remain = files[f].size;
+
+    if (!remain)
+      continue;
+
+    in = fopen(files[f].path, "rb");
+    if (!in) {
+      perror(files[f].path);
+      return 1;
+    }
+
+    sect = l->database + (files[f].clust - 2) * l->csize;
+    while (remain) {
+      uint32_t len = remain < SECTOR ? remain : SECTOR;
+
+      memset(buf, 0, SECTOR);
+      if (fread(buf, 1, len, in) != len) {
+        perror(files[f].path);
+        return 1;
+      }
+      if (write_sectors(part + sect, buf, 1))
+        return 1;
+      /* the firmware is stored in the raw partition as well */
+      if (raw && f == 0 &&
+          write_sectors(RAW_START + (files[f].size - remain) / SECTOR, buf, 1))
+        return 1;
+      sect++;
+      remain -= len;
+    }
+    fclose(in);
+  }
+
+  free(buf);
+  return 0;
+}
+
+static void usage(void) {
+  printf("Usage: mkcard [-F 16|32] [-s size] [-r] <image or device> <firmware> [files...]\r\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct file   files[MAX_FILES];
+  struct layout l;
+  uint64_t size = 0;
+  int      fattype = 0;
+  int      nfiles, i, j;
+
+  while (argc > 1 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-F") && argc > 2) {
+      fattype = atoi(argv[2]);
+      if (fattype != 16 && fattype != 32) {
+        usage();
+        return 1;
+      }
+    } else if (!strcmp(argv[1], "-s") && argc > 2) {
+      if (parse_size(argv[2], &size)) {
+        printf("Invalid size %s\r\n", argv[2]);
+        return 1;
+      }
+    } else if (!strcmp(argv[1], "-r")) {
+      raw = 1;
+      argc--;
+      argv++;
+      continue;
+    } else {
+      usage();
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc < 3) {
+    usage();
+    return 1;
+  }
+
+  nfiles = argc - 2;
+  if (nfiles > MAX_FILES) {
+    printf("Too many files, at most %d are supported\r\n", MAX_FILES);
+    return 1;
+  }
+
+  for (i = 0; i < nfiles; i++) {
+    FILE *in;
+    long  len;
+
+    files[i].path = argv[i + 2];
+    make_name(files[i].name, files[i].path);
+
+    in = fopen(files[i].path, "rb");
+    if (!in || fseek(in, 0, SEEK_END) || (len = ftell(in)) < 0) {
+      printf("Unable to open file %s\r\n", files[i].path);
+      return 1;
+    }
+    fclose(in);
+    files[i].size = len;
+
+    for (j = 0; j < i; j++)
+      if (!memcmp(files[i].name, files[j].name, 11)) {
+        printf("%s: Duplicate name %.11s\r\n", files[i].path, files[i].name);
+        return 1;
+      }
+  }
+
+  if (raw && (files[0].size == 0 || files[0].size > RAW_MAX * SECTOR)) {
+    printf("%s does not fit in a raw partition\r\n", files[0].path);
+    return 1;
+  }
+
+  /* open an existing image or device, create a new image */
+  out = fopen(argv[1], "rb+");
+  if (!out && size)
+    out = fopen(argv[1], "wb+");
+  if (!out) {
+    printf("Unable to open file %s\r\n", argv[1]);
+    return 1;
+  }
+
+  if (!size) {
+    if (fseeko(out, 0, SEEK_END) || (int64_t)(size = ftello(out)) < 0) {
+      perror("fseek");
+      return 1;
+    }
+    if (!size) {
+      printf("Size of %s unknown, use -s\r\n", argv[1]);
+      return 1;
+    }
+  }
+
+  if (size / SECTOR <= PART_START ||
+      choose_layout(&l, fattype, size / SECTOR - PART_START)) {
+    printf("No valid FAT%s layout for %llu bytes\r\n",
+           fattype ? (fattype == 16 ? "16" : "32") : "16/32",
+           (unsigned long long)size);
+    return 1;
+  }
+
+  printf("FAT%d, %u sectors per cluster, %u clusters\r\n",
+         l.fat32 ? 32 : 16, l.csize, l.clusters);
+
+  if (write_filesystem(&l, files, nfiles))
+    return 1;
+
+  /* make sure a new image file has the full size */
+  {
+    uint8_t zero[SECTOR] = { 0 };
+    uint64_t last = size / SECTOR - 1;
+
+    if (fseeko(out, 0, SEEK_END) == 0 && (uint64_t)ftello(out) < size &&
+        write_sectors(last, zero, 1))
+      return 1;
+  }
+
+  if (fclose(out)) {
+    perror("fclose");
+    return 1;
+  }
+
+  return 0;
+}
@@ -33,10 +33,14 @@
 
 */
 
+#include <stddef.h>
 #include <avr/io.h>
 #include <util/crc16.h>
 #include <util/delay.h>
 #include "config.h"
+#if defined(CONFIG_CARD_PROBE) || defined(CONFIG_SD_TRACE)
+#  include "bootapi.h"
+#endif
 #include "diskio.h"
 
 /* SD/MMC commands */
@@ -87,8 +91,6 @@
 #define CARD_MMCSD 0
 #define CARD_SDHC  1
 
-static uint8_t cardtype;
-
 /* ---- SPI functions ---- */
 
 static void spi_set_ss(uint8_t state) {
@@ -137,21 +139,77 @@ static void spi_exchange_long(uint32_t *value) {
   }
 }
 
+/* ---- Command trace ---- */
+
+#ifdef CONFIG_SD_TRACE
+#  ifdef CONFIG_SERVICE_TABLE
+#    error "CONFIG_SD_TRACE can not be combined with CONFIG_SERVICE_TABLE"
+#  endif
+
+/* kept over a watchdog reset, main.c clears it */
+sd_trace_t sd_trace __attribute__((section(".noinit")));
+
+/* Timer 1, started at prescaler 1024 if nothing else did */
+static uint16_t trace_clock(void) {
+  if (!TCCR1B)
+    TCCR1B = _BV(CS12) | _BV(CS10);
+
+  return TCNT1;
+}
+
+static void trace_command(uint8_t cmd, uint32_t arg, uint8_t r1, uint16_t time) {
+  sd_trace_entry_t *e = &sd_trace.entry[sd_trace.next];
+
+  e->cmd  = cmd;
+  e->r1   = r1;
+  e->spi  = (SPCR & 3) | ((SPSR & _BV(SPI2X)) << 2);
+  e->arg  = arg;
+  e->wait = 0;
+  e->time = time;
+
+  if (++sd_trace.next == SD_TRACE_ENTRIES)
+    sd_trace.next = 0;
+  if (sd_trace.count != 0xffff)
+    sd_trace.count++;
+}
+
+/* add the wait for the data token to the last command */
+static void trace_wait(uint16_t wait) {
+  uint8_t last = sd_trace.next ? sd_trace.next - 1 : SD_TRACE_ENTRIES - 1;
+
+  sd_trace.entry[last].wait = wait;
+}
+#endif
+
 /* ---- SD functions ---- */
 
 static uint8_t send_command(uint8_t cmd, uint32_t parameter, uint8_t crc) {
   uint16_t loops = ~0;
   uint8_t  res;
+#ifdef CONFIG_SD_TRACE
+  uint32_t arg  = parameter;
+  uint16_t time = trace_clock();
+#endif
 
   spi_set_ss(0);
   spi_exchange_byte(cmd);
   spi_exchange_long(&parameter);
   spi_exchange_byte(crc);
 
+#ifdef CONFIG_CARD_PROBE
+  /* the byte after STOP_TRANSMISSION is a stuff byte from the */
+  /* interrupted data transfer, not the start of the response  */
+  if (cmd == STOP_TRANSMISSION)
+    spi_exchange_byte(0xff);
+#endif
+
   do {
     res = spi_exchange_byte(0xff);
   } while ((res & 0x80) && --loops != 0);
 
+#ifdef CONFIG_SD_TRACE
+  trace_command(cmd, arg, res, time);
+#endif
   return res;
 }
 
@@ -163,10 +221,32 @@ static void deselect_card(void) {
   spi_exchange_byte(0xff);
 }
 
-DSTATUS disk_initialize(void) {
+#ifdef CONFIG_BACKGROUND_CRC
+/**
+ * disk_initialize_poll - initialize the card, calling a function while waiting
+ * @type: pointer to the card type
+ * @poll: function called while the card powers up, may be NULL
+ *
+ * This function works like disk_initialize, but calls @poll each time
+ * the card reported that it is still initializing. @poll should return
+ * quickly, the card is not polled while it runs.
+ */
+DSTATUS disk_initialize_poll(BYTE *type, void (*poll)(void)) {
+#else
+/**
+ * disk_initialize - initialize the card
+ * @type: pointer to the card type
+ *
+ * This function initializes the SPI interface and the card. On success,
+ * the card type that must be passed to disk_read is stored in @type.
+ * No static variables are used, so this function can also be called by
+ * an application through the service table.
+ */
+DSTATUS disk_initialize(BYTE *type) {
+#endif
   uint32_t parameter;
   uint16_t tries = 3;
-  uint8_t  i,res;
+  uint8_t  i,res,cardtype;
 
   spi_init();
  retry:
@@ -207,16 +287,28 @@ DSTATUS disk_initialize(void) {
     res = send_command(APP_CMD, 0, 0xff);
     deselect_card();
     if (res != 1)
+#ifdef CONFIG_DISABLE_MMC
+      return STA_NOINIT;
+#else
       goto not_sd;
+#endif
 
     /* send SD_SEND_OP_COND */
     res = send_command(SD_SEND_OP_COND, 1L<<30, 0xff);
     deselect_card();
+#ifdef CONFIG_BACKGROUND_CRC
+    if (res == 1 && poll)
+      poll();
+#endif
   } while (res == 1 && --tries > 0);
 
   /* failure just means that the card isn't SDHC */
   if (res != 0)
+#ifdef CONFIG_DISABLE_MMC
+    return STA_NOINIT;
+#else
     goto not_sd;
+#endif
 
   /* send READ_OCR to detect SDHC cards */
   res = send_command(READ_OCR, 0, 0xff);
@@ -231,16 +323,22 @@ DSTATUS disk_initialize(void) {
 
   deselect_card();
 
+#ifndef CONFIG_DISABLE_MMC
  not_sd:
   /* tell MMC cards to initialize (SD ignores this) */
   tries = 65535;
   do {
     res = send_command(SEND_OP_COND, 1L<<30, 0xff);
     deselect_card();
+#ifdef CONFIG_BACKGROUND_CRC
+    if (res != 0 && poll)
+      poll();
+#endif
   } while (res != 0 && --tries > 0);
 
   if (res != 0)
     return STA_NOINIT;
+#endif
 
   /* set block size to 512 */
   res = send_command(SET_BLOCKLEN, 512, 0xff);
@@ -250,12 +348,83 @@ DSTATUS disk_initialize(void) {
 
   spi_set_speed(1);
 
+  *type = cardtype;
   return 0;
 }
 
-DRESULT disk_read(BYTE *buffer, DWORD sector) {
+#ifdef CONFIG_BACKGROUND_CRC
+/**
+ * disk_initialize - initialize the card
+ * @type: pointer to the card type
+ *
+ * This function initializes the SPI interface and the card. On success,
+ * the card type that must be passed to disk_read is stored in @type.
+ * No static variables are used, so this function can also be called by
+ * an application through the service table.
+ */
+DSTATUS disk_initialize(BYTE *type) {
+  return disk_initialize_poll(type, NULL);
+}
+#endif
+
+#ifdef CONFIG_WARM_START
+/**
+ * disk_resume - take over a card that is already initialized
+ * @type: card type returned by an earlier disk_initialize
+ *
+ * This function sets up the SPI interface at full speed and checks
+ * that the card answers SEND_STATUS without errors, which is only the
+ * case if it left its initialization phase. Returns STA_NOINIT if the
+ * card must be initialized again.
+ */
+DSTATUS disk_resume(BYTE type) {
   uint8_t res;
-  uint16_t i;
+
+  if (type != CARD_MMCSD && type != CARD_SDHC)
+    return STA_NOINIT;
+
+  spi_init();
+  spi_set_speed(1);
+
+  /* finish any command the application left the card in */
+  deselect_card();
+
+  /* R2 response, the second byte must be 0 as well */
+  res = send_command(SEND_STATUS, 0, 0xff);
+  if (res == 0)
+    res = spi_exchange_byte(0xff);
+  deselect_card();
+  if (res != 0)
+    return STA_NOINIT;
+
+  /* the application may have changed the block length */
+  res = send_command(SET_BLOCKLEN, 512, 0xff);
+  deselect_card();
+  if (res != 0)
+    return STA_NOINIT;
+
+  return 0;
+}
+#endif
+
+/**
+ * disk_read_crc - read a sector and update a CRC
+ * @cardtype: card type from disk_initialize
+ * @buffer  : buffer for the sector contents
+ * @sector  : sector number
+ * @crc     : pointer to the CRC to update, NULL if not needed
+ *
+ * This function reads a sector from the card. If @crc is not NULL,
+ * each byte is folded into the CRC-CCITT pointed to by it while
+ * the next byte is transferred, so the CRC is calculated without
+ * slowing down the transfer.
+ */
+DRESULT disk_read_crc(BYTE cardtype, BYTE *buffer, DWORD sector, WORD *crc) {
+  uint8_t res;
+  uint16_t i, c;
+#ifdef CONFIG_SD_TRACE
+  uint16_t wait = 0;
+#endif
 
   /* convert sector number to byte offset for non-SDHC cards */
   if (cardtype == CARD_MMCSD)
@@ -273,17 +442,40 @@ DRESULT disk_read(BYTE *buffer, DWORD sector) {
   // FIXME: Timeout?
   do {
     res = spi_exchange_byte(0xff);
+#ifdef CONFIG_SD_TRACE
+    if (wait != 0xffff)
+      wait++;
+#endif
   } while (res != 0xfe);
 
-  /* transfer data */
-  SPDR = 0xff;
-  for (i=0; i<512; i++) {
-    uint8_t tmp;
+#ifdef CONFIG_SD_TRACE
+  /* the token itself is not counted */
+  trace_wait(wait - 1);
+#endif
 
-    loop_until_bit_is_set(SPSR, SPIF);
-    tmp = SPDR;
-    SPDR = 0xff;
-    *buffer++ = tmp;
+  /* transfer data, separate loops keep the plain read as fast as before */
+  SPDR = 0xff;
+  if (crc) {
+    c = *crc;
+    for (i=0; i<512; i++) {
+      uint8_t tmp;
+
+      loop_until_bit_is_set(SPSR, SPIF);
+      tmp = SPDR;
+      SPDR = 0xff;
+      *buffer++ = tmp;
+      c = _crc_ccitt_update(c, tmp);
+    }
+    *crc = c;
+  } else {
+    for (i=0; i<512; i++) {
+      uint8_t tmp;
+
+      loop_until_bit_is_set(SPSR, SPIF);
+      tmp = SPDR;
+      SPDR = 0xff;
+      *buffer++ = tmp;
+    }
   }
   loop_until_bit_is_set(SPSR, SPIF);
 
@@ -292,6 +484,247 @@ DRESULT disk_read(BYTE *buffer, DWORD sector) {
   spi_exchange_byte(0xff);
 
   deselect_card();
+
   return RES_OK;
 }
 
+DRESULT disk_read(BYTE cardtype, BYTE *buffer, DWORD sector) {
+  return disk_read_crc(cardtype, buffer, sector, NULL);
+}
+
+#if defined(CONFIG_CARD_HANDOFF) || defined(CONFIG_CARD_PROBE)
+/**
+ * disk_ioctl - miscellaneous card functions
+ * @cardtype: card type from disk_initialize
+ * @ctrl    : control code
+ * @buff    : buffer for the result
+ *
+ * Only MMC_GET_CID is supported, it stores the 16 bytes of the CID
+ * register in @buff.
+ */
+DRESULT disk_ioctl(BYTE cardtype, BYTE ctrl, void *buff) {
+  uint8_t *cid = buff;
+  uint8_t  i, res;
+  uint16_t loops = ~0;
+
+  if (ctrl != MMC_GET_CID)
+    return RES_PARERR;
+
+  res = send_command(SEND_CID, 0, 0xff);
+  if (res != 0) {
+    deselect_card();
+    return RES_ERROR;
+  }
+
+  /* wait for data token */
+  do {
+    res = spi_exchange_byte(0xff);
+  } while (res != 0xfe && --loops != 0);
+
+  if (res != 0xfe) {
+    deselect_card();
+    return RES_ERROR;
+  }
+
+  for (i=0; i<16; i++)
+    *cid++ = spi_exchange_byte(0xff);
+
+  /* drop CRC */
+  spi_exchange_byte(0xff);
+  spi_exchange_byte(0xff);
+  deselect_card();
+
+  return RES_OK;
+}
+#endif
+
+#ifdef CONFIG_CARD_PROBE
+/* ---- Card probe ---- */
+
+/* restart Timer 1 with the given clock select bits, 0 stops it */
+static void probe_timer(uint8_t cs) {
+  TCCR1B = 0;
+  TCNT1  = 0;
+  TIFR1  = _BV(TOV1);
+  TCCR1B = cs;
+}
+
+/* Timer 1 count since probe_timer, 0xffff if it overflowed */
+static uint16_t probe_elapsed(void) {
+  uint16_t t = TCNT1;
+
+  if (TIFR1 & _BV(TOV1))
+    return 0xffff;
+
+  return t;
+}
+
+/* set the SPI clock to F_CPU/(2<<n) */
+static void probe_divider(uint8_t n) {
+  if (n >= 6) {
+    SPSR = 0;
+    SPCR = 0b01010000 | _BV(SPR1) | _BV(SPR0);
+  } else {
+    /* SPI2X halves the clock divider selected by SPR1/SPR0 */
+    SPSR = (n & 1) ? 0 : _BV(SPI2X);
+    SPCR = 0b01010000 | (n >> 1);
+  }
+}
+
+/* wait for the data token, returns 0 if it did not arrive */
+static uint8_t probe_token(void) {
+  uint16_t loops = ~0;
+  uint8_t  res;
+
+  do {
+    res = spi_exchange_byte(0xff);
+  } while (res == 0xff && --loops != 0);
+
+  return res == 0xfe;
+}
+
+/* clock a data block and its CRC through without looking at it */
+static void probe_transfer(void) {
+  uint16_t i;
+
+  SPDR = 0xff;
+  for (i=0; i<513; i++) {
+    loop_until_bit_is_set(SPSR, SPIF);
+    SPDR = 0xff;
+  }
+  loop_until_bit_is_set(SPSR, SPIF);
+  (void)SPDR;
+}
+
+/* read a data block and its CRC, returns 0 if the CRC is wrong */
+static uint8_t probe_block(void) {
+  uint16_t i, crc = 0;
+
+  /* same overlap as in disk_read_crc, the CRC of the card */
+  /* is included so the result is 0 for a correct block    */
+  SPDR = 0xff;
+  for (i=0; i<514; i++) {
+    uint8_t tmp;
+
+    loop_until_bit_is_set(SPSR, SPIF);
+    tmp = SPDR;
+    if (i != 513)
+      SPDR = 0xff;
+    crc = _crc_xmodem_update(crc, tmp);
+  }
+
+  return crc == 0;
+}
+
+/* read the first sectors with READ_MULTIPLE_BLOCK, */
+/* returns 0 if the card reported an error          */
+static uint8_t probe_multiple(uint8_t check) {
+  uint8_t i, ok;
+
+  ok = send_command(READ_MULTIPLE_BLOCK, 0, 0xff) == 0;
+  for (i=0; ok && i<CARD_PROBE_SECTORS; i++) {
+    ok = probe_token();
+    if (ok && check)
+      ok = probe_block();
+    else if (ok)
+      probe_transfer();
+  }
+
+  return ok;
+}
+
+/* end a READ_MULTIPLE_BLOCK */
+static void probe_stop(void) {
+  uint16_t loops = ~0;
+
+  send_command(STOP_TRANSMISSION, 0, 0xff);
+
+  /* wait until the card is no longer busy */
+  while (spi_exchange_byte(0xff) != 0xff && --loops != 0) ;
+
+  deselect_card();
+}
+
+/**
+ * disk_probe - measure the timing of the card
+ * @type  : pointer to the card type
+ * @result: results, see bootapi.h
+ *
+ * This function initializes the card again and fills the measurement
+ * fields of @result, which must be cleared by the caller. Timer 1 is used for the measurements and left
+ * stopped. The card is left initialized at the usual SPI clock if the
+ * initialization worked, the first CARD_PROBE_SECTORS sectors of the
+ * card are read.
+ */
+DSTATUS disk_probe(BYTE *type, card_probe_t *result) {
+  uint32_t address;
+  uint16_t t;
+  uint8_t  i, n, ok;
+
+  /* initialization including the SPI setup */
+  probe_timer(_BV(CS12) | _BV(CS10));
+  if (disk_initialize(type) & STA_NOINIT) {
+    probe_timer(0);
+    return STA_NOINIT;
+  }
+  result->init_time = probe_elapsed();
+  result->cardtype  = *type;
+
+  /* cid stays cleared if the card does not send it */
+  disk_ioctl(*type, MMC_GET_CID, result->cid);
+
+  /* latency of single block reads */
+  for (i=0; i<CARD_PROBE_SECTORS; i++) {
+    address = (*type == CARD_MMCSD) ? (uint32_t)i << 9 : i;
+
+    probe_timer(_BV(CS11));
+    ok = send_command(READ_SINGLE_BLOCK, address, 0xff) == 0 && probe_token();
+    t  = probe_elapsed();
+    if (ok)
+      ok = probe_block();
+    deselect_card();
+
+    if (!ok)
+      t = 0xffff;
+    if (t > result->token_max)
+      result->token_max = t;
+    if ((uint32_t)result->token_sum + t > 0xffff)
+      result->token_sum = 0xffff;
+    else
+      result->token_sum += t;
+  }
+
+  /* multiple block reads from the slowest to the fastest clock */
+  result->errors  = 0;
+  result->fastest = CARD_PROBE_DIVIDERS;
+  n = CARD_PROBE_DIVIDERS;
+  while (n-- > 0) {
+    probe_divider(n);
+
+    /* only the transfer is timed, the CRC is calculated */
+    /* while reading the same sectors a second time      */
+    probe_timer(_BV(CS11) | _BV(CS10));
+    ok = probe_multiple(0);
+    t  = probe_elapsed();
+    probe_stop();
+    if (ok) {
+      ok = probe_multiple(1);
+      probe_stop();
+    }
+    result->read_time[n] = ok ? t : 0xffff;
+
+    if (!ok)
+      result->errors |= 1 << n;
+    else if (result->fastest == n+1)
+      result->fastest = n;
+  }
+
+  probe_timer(0);
+
+  /* back to the clock used by disk_read */
+  SPSR = _BV(SPI2X);
+  spi_set_speed(1);
+
+  return 0;
+}
+#endif
@@ -0,0 +1,543 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   sdreplay.c: Decodes SD command traces and replays them on the host
+
+   A trace written by a boot loader built with CONFIG_SD_TRACE is read
+   from a USART capture or an EEPROM image and listed with the SPI
+   clock and the time the card made the boot loader wait for data.
+   Given a card image or card reader, the boot loader's search runs on
+   it through ff.c and img_select from imagecheck.h, like in cardaudit.
+   Every sector read is charged the time the device spent on the same
+   sector in the trace, or the average of the traced reads for sectors
+   the trace does not hold, so a slow field report can be compared
+   with the search the same card causes with other settings.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "ff.h"
+#include "hostdisk.h"
+#include "imagecheck.h"
+
+/* layout of a written trace, see sd_trace_dump_t in bootapi.h */
+#define TRACE_MAGIC    0x5453
+#define MAX_ENTRIES    255
+#define ENTRY_BYTES    11
+#define HEADER_BYTES   8
+#define MAX_BYTES      (HEADER_BYTES + MAX_ENTRIES * ENTRY_BYTES + 2)
+
+#define MAX_LENGTH     0x1000000UL
+#define CARD_MMCSD     0
+
+struct entry {
+  uint8_t  cmd, r1, spi;
+  uint32_t arg;
+  uint16_t wait;
+  double   ms;      /* since the first command of the trace */
+};
+
+struct trace {
+  unsigned int cpu_khz, count, cardtype, entries;
+  struct entry entry[MAX_ENTRIES];
+};
+
+/* time charged for the sector reads of the replayed search */
+struct model {
+  uint32_t     sector[MAX_ENTRIES];
+  double       ms[MAX_ENTRIES];   /* from the read to the next command */
+  uint8_t      used[MAX_ENTRIES];
+  unsigned int known;
+  double       average;           /* of all traced reads */
+  double       init_ms;           /* card initialization, 0 if not traced */
+  double       total_ms;
+  unsigned int reads, guessed;
+  int          paced;
+};
+
+static const struct {
+  uint8_t     index;
+  const char *name;
+} commands[] = {
+  {  0, "GO_IDLE_STATE" },
+  {  1, "SEND_OP_COND" },
+  {  8, "SEND_IF_COND" },
+  { 10, "SEND_CID" },
+  { 12, "STOP_TRANSMISSION" },
+  { 13, "SEND_STATUS" },
+  { 16, "SET_BLOCKLEN" },
+  { 17, "READ_SINGLE_BLOCK" },
+  { 18, "READ_MULTIPLE_BLOCK" },
+  { 41, "SD_SEND_OP_COND" },
+  { 55, "APP_CMD" },
+  { 58, "READ_OCR" },
+};
+
+/* settings of the simulated boot loader */
+static unsigned long length, devid;
+static uint8_t varlen, single_pass, raw_partition, bundles;
+
+/* same as _crc_ccitt_update from avr-libc */
+static uint16_t crc_ccitt_update(uint16_t crc, uint8_t data) {
+  data ^= crc & 0xff;
+  data ^= data << 4;
+
+  return (((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
+    ^ ((uint16_t)data << 3);
+}
+
+static unsigned int get16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const char *command_name(uint8_t cmd) {
+  unsigned int i;
+
+  for (i=0; i<sizeof(commands)/sizeof(commands[0]); i++)
+    if (commands[i].index == (cmd & 0x3f))
+      return commands[i].name;
+
+  return "?";
+}
+
+/* SPI clock of an entry in kHz */
+static double spi_khz(const struct trace *t, uint8_t spi) {
+  static const unsigned int dividers[8] = { 4, 16, 64, 128, 2, 8, 32, 64 };
+
+  return (double)t->cpu_khz / dividers[spi & 7];
+}
+
+/* check and unpack a raw trace of up to size bytes, returns 0 on success */
+static int parse_trace(struct trace *t, const uint8_t *raw, size_t size) {
+  uint16_t crc = 0xffff;
+  unsigned int i, bytes, last = 0;
+  double   ms = 0;
+
+  if (size < HEADER_BYTES + 2 || get16(raw) != TRACE_MAGIC)
+    return 1;
+
+  t->entries = raw[6];
+  bytes = HEADER_BYTES + t->entries * ENTRY_BYTES + 2;
+  if (bytes > size)
+    return 1;
+
+  for (i=0; i<bytes-2; i++)
+    crc = crc_ccitt_update(crc, raw[i]);
+  if (crc != get16(raw + bytes - 2))
+    return 1;
+
+  t->cpu_khz  = get16(raw + 2);
+  t->count    = get16(raw + 4);
+  t->cardtype = raw[7];
+  if (t->cpu_khz == 0)
+    return 1;
+
+  /* the entries are written from the oldest to the newest */
+  for (i=0; i<t->entries; i++) {
+    const uint8_t *p = raw + HEADER_BYTES + i * ENTRY_BYTES;
+    struct entry  *e = &t->entry[i];
+    unsigned int   time = get16(p + 9);
+
+    /* Timer 1 runs at F_CPU/1024 and wraps around */
+    if (i > 0)
+      ms += ((time - last) & 0xffff) * 1024.0 / t->cpu_khz;
+    last = time;
+
+    e->cmd  = p[0];
+    e->r1   = p[1];
+    e->spi  = p[2];
+    e->arg  = get32(p + 3);
+    e->wait = get16(p + 7);
+    e->ms   = ms;
+  }
+
+  return 0;
+}
+
+/* find a trace in a USART capture or an EEPROM image */
+static int read_trace(struct trace *t, const char *name) {
+  uint8_t raw[MAX_BYTES], *data;
+  const char *line;
+  size_t size, i;
+  long   len;
+  FILE  *f;
+
+  f = fopen(name, "rb");
+  if (f == 0 || fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0) {
+    printf("Unable to open file %s\r\n", name);
+    return 1;
+  }
+  size = len;
+  data = malloc(size + 1);
+  fseek(f, 0, SEEK_SET);
+  if (!data || fread(data, 1, size, f) != size) {
+    perror(name);
+    return 1;
+  }
+  fclose(f);
+  data[size] = 0;
+
+  /* text line from the USART, the last one wins */
+  line = NULL;
+  for (i=0; i + 8 <= size; i++)
+    if (!memcmp(data + i, "NBTRACE ", 8))
+      line = (const char *)data + i + 8;
+
+  if (line) {
+    for (i=0; i<MAX_BYTES; i++) {
+      unsigned int byte;
+
+      if (sscanf(line + 2*i, "%2x", &byte) != 1)
+        break;
+      raw[i] = byte;
+    }
+    if (parse_trace(t, raw, i) == 0) {
+      free(data);
+      return 0;
+    }
+  } else {
+    /* binary EEPROM image, the trace is found by its magic and CRC */
+    for (i=0; i < size; i++)
+      if (parse_trace(t, data + i, size - i) == 0) {
+        free(data);
+        return 0;
+      }
+  }
+
+  printf("%s: No valid trace found\r\n", name);
+  free(data);
+  return 1;
+}
+
+static void list_trace(const struct trace *t) {
+  unsigned int i;
+
+  printf("%u commands traced, the last %u kept, %s card, CPU at %u kHz\r\n",
+         t->count, t->entries, t->cardtype == CARD_MMCSD ? "MMC/SD" : "SDHC",
+         t->cpu_khz);
+  printf("    time ms  command                    argument  R1  SPI kHz  token wait us\r\n");
+
+  for (i=0; i<t->entries; i++) {
+    const struct entry *e = &t->entry[i];
+    double khz = spi_khz(t, e->spi);
+
+    printf("  %9.3f  CMD%-2u %-19s  %08lx  %02x  %7.1f",
+           e->ms, e->cmd & 0x3f, command_name(e->cmd), (unsigned long)e->arg,
+           e->r1, khz);
+    if (e->wait)
+      /* eight clocks per byte read while waiting */
+      printf("  %13.1f", e->wait * 8 * 1000.0 / khz);
+    printf("\r\n");
+  }
+}
+
+static double now_ms(void) {
+#ifdef _WIN32
+  return (double)clock() * 1000 / CLOCKS_PER_SEC;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+static void sleep_ms(double ms) {
+#ifdef _WIN32
+  double end = now_ms() + ms;
+
+  while (now_ms() < end) ;
+#else
+  struct timespec ts;
+
+  ts.tv_sec  = ms / 1000;
+  ts.tv_nsec = (ms - ts.tv_sec * 1000.0) * 1e6;
+  nanosleep(&ts, NULL);
+#endif
+}
+
+static int is_read(const struct entry *e) {
+  return (e->cmd & 0x3f) == 17 && e->r1 == 0;
+}
+
+/* learn the time of each traced sector read, which includes the */
+/* wait for the card and the work of the boot loader until the   */
+/* next command                                                  */
+static void build_model(struct model *m, const struct trace *t) {
+  unsigned int i;
+  double sum = 0;
+
+  memset(m, 0, sizeof(*m));
+
+  for (i=0; i+1<t->entries; i++) {
+    const struct entry *e = &t->entry[i];
+    uint32_t sector = e->arg;
+
+    if (!is_read(e))
+      continue;
+
+    /* byte addresses on cards before SDHC */
+    if (t->cardtype == CARD_MMCSD)
+      sector >>= 9;
+
+    m->sector[m->known] = sector;
+    m->ms[m->known]     = t->entry[i+1].ms - e->ms;
+    sum += m->ms[m->known];
+    m->known++;
+  }
+
+  if (m->known)
+    m->average = sum / m->known;
+
+  /* the initialization is only in a trace that kept every command */
+  if (t->count == t->entries)
+    for (i=0; i<t->entries; i++)
+      if (is_read(&t->entry[i])) {
+        m->init_ms = t->entry[i].ms;
+        break;
+      }
+}
+
+/* charge a sector read of the replayed search, called by hostdisk.c */
+static void model_read(struct hostcard *card, uint32_t sector) {
+  struct model *m = card->ctx;
+  unsigned int i;
+  double ms;
+
+  /* the n-th read of a sector is charged its n-th traced read, */
+  /* reads the trace does not hold the average                  */
+  for (i=0; i<m->known; i++)
+    if (m->sector[i] == sector && !m->used[i])
+      break;
+
+  if (i < m->known) {
+    m->used[i] = 1;
+    ms = m->ms[i];
+  } else {
+    ms = m->average;
+    m->guessed++;
+  }
+
+  printf("  %-10lu  %9.3f  %s\r\n", (unsigned long)sector, ms,
+         i < m->known ? "traced" : "average");
+
+  if (m->paced)
+    sleep_ms(ms);
+
+  m->total_ms += ms;
+  m->reads++;
+}
+
+static imgresult_t replay_accept(img_select_t *s) {
+  /* the simulated flash is empty */
+  return img_accept(s->bi, 0xffff, 0xffff, 0);
+}
+
+/* run the search of the boot loader on a card with the traced timing */
+static int replay_trace(const struct trace *t, const char *name, int paced) {
+  struct hostcard card;
+  struct model m;
+  FATFS        fat;
+  DIR          dh;
+  FILINFO      finfo;
+  FIL          fd;
+  uint8_t      databuffer[512];
+  bootinfo_t   bi;
+  img_select_t sel;
+  const char  *chosen = NULL;
+  double       start, traced;
+  FRESULT      fr;
+
+  build_model(&m, t);
+  m.paced = paced;
+  if (m.known == 0) {
+    printf("The trace holds no sector reads\r\n");
+    return 1;
+  }
+
+  if (hostcard_open(&card, name))
+    return 1;
+
+  card.read_hook = model_read;
+  card.ctx       = &m;
+  hostdisk_select(0, &card);
+
+  memset(&sel, 0, sizeof(sel));
+  sel.fs          = &fat;
+  sel.dir         = &dh;
+  sel.fi          = &finfo;
+  sel.fp          = &fd;
+  sel.buf         = databuffer;
+  sel.bi          = &bi;
+  sel.devid       = devid;
+  sel.length      = length;
+  sel.varlen      = varlen;
+  sel.single_pass = single_pass;
+  sel.bundles     = bundles;
+  sel.accept      = replay_accept;
+
+  printf("\r\nSearch on %s:\r\n", name);
+  printf("  sector           ms\r\n");
+
+  start = now_ms();
+  fr = f_mount(raw_partition ? MOUNT_RAW : 0, &fat);
+  if (fr == FR_OK && fat.fs_type == FS_RAW) {
+    /* like raw_update in main.c */
+    imgresult_t res = img_check_raw(&sel);
+
+    if (res == IMG_OK)
+      chosen = "raw partition";
+    else if (res != IMG_SAME && res != IMG_OLDER)
+      fr = f_mount(0, &fat);
+  }
+
+  if (fr != FR_OK) {
+    printf("  no FAT file system found\r\n");
+  } else if (fat.fs_type != FS_RAW) {
+    img_select(&sel);
+    if (sel.found)
+      chosen = (char *)sel.best.fname;
+  }
+
+  if (chosen)
+    printf("chosen: %s\r\n", chosen);
+  else
+    printf("no update\r\n");
+
+  /* the traced time ends with the last command */
+  traced = t->entry[t->entries - 1].ms;
+  if (is_read(&t->entry[t->entries - 1]))
+    traced += m.average;
+
+  printf("%u sectors read, %u of them charged the average\r\n",
+         m.reads, m.guessed);
+  printf("modelled %.1f ms", m.init_ms + m.total_ms);
+  if (m.init_ms)
+    printf(" (%.1f ms initialization)", m.init_ms);
+  printf(", traced %.1f ms", traced);
+  if (paced)
+    printf(", %.1f ms on the host", now_ms() - start + m.init_ms);
+  printf("\r\n");
+  if (t->count != t->entries)
+    printf("The trace only holds the last %u of %u commands\r\n",
+           t->entries, t->count);
+
+  hostcard_close(&card);
+  return 0;
+}
+
+/* parse a number with range check */
+static int parse_number(const char *str, unsigned long max, unsigned long *value) {
+  unsigned long long v;
+  char *end;
+
+  errno = 0;
+  v = strtoull(str, &end, 0);
+  if (errno || end == str || *end || *str == '-' || v > max) {
+    printf("Invalid number %s (maximum 0x%lx)\r\n", str, max);
+    return 1;
+  }
+
+  *value = v;
+  return 0;
+}
+
+static void usage(void) {
+  printf("Usage: sdreplay [-v] [-s] [-r] [-b] [-p] <trace> [<length> <signature> <card>]\r\n"
+         "  <trace>  USART capture with an NBTRACE line or EEPROM image\r\n"
+         "  <card>   run the search on a card image or card reader with the\r\n"
+         "           timing of the trace\r\n"
+         "  -v       boot loader built with CONFIG_VARIABLE_LENGTH\r\n"
+         "  -s       boot loader built with CONFIG_SINGLE_PASS_UPDATE\r\n"
+         "  -r       boot loader built with CONFIG_RAW_PARTITION\r\n"
+         "  -b       boot loader built with CONFIG_BUNDLE\r\n"
+         "  -p       wait the modelled time for each read\r\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct trace t;
+  int paced = 0;
+
+  argc--;
+  argv++;
+  while (argc > 0 && argv[0][0] == '-') {
+    if (!strcmp(argv[0], "-p")) {
+      paced = 1;
+    } else if (!strcmp(argv[0], "-v")) {
+      varlen = 1;
+    } else if (!strcmp(argv[0], "-s")) {
+      single_pass = 1;
+    } else if (!strcmp(argv[0], "-r")) {
+      raw_partition = 1;
+    } else if (!strcmp(argv[0], "-b")) {
+      bundles = 1;
+    } else {
+      usage();
+      return 1;
+    }
+    argc--;
+    argv++;
+  }
+
+  if (argc != 1 && argc != 4) {
+    usage();
+    return 1;
+  }
+
+  if (argc == 4) {
+    if (parse_number(argv[1], MAX_LENGTH, &length) ||
+        parse_number(argv[2], 0xffffffffUL, &devid))
+      return 1;
+
+    if (length < 512 || length % 512) {
+      printf("The length must be a multiple of 512\r\n");
+      return 1;
+    }
+  }
+
+  if (read_trace(&t, argv[0]))
+    return 1;
+
+  list_trace(&t);
+
+  if (argc == 4)
+    return replay_trace(&t, argv[3], paced);
+
+  return 0;
+}
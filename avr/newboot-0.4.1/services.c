@@ -0,0 +1,68 @@
+/* newboot - an AVR MMC/SD boot loader compatible with HolgerBootloader2
+   Based on a heavily modified version of ChaN's FatFs library
+
+   Copyright (C) 2011  Ingo Korb <ingo@akana.de>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   1. Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+   3. Neither the name of the University nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+   FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+   DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+   OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+   OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+   SUCH DAMAGE.
+
+
+   services.c: Service table for applications
+
+   The service table is placed at SVC_TABLE_ADDR by the linker and gives
+   applications access to the SD, FAT and CRC code of the boot loader.
+   See bootapi.h for the calling conventions.
+
+*/
+
+#include "bootapi.h"
+#include "crc.h"
+#include "diskio.h"
+#include "ff.h"
+
+typedef void (*svc_entry_t)(void);
+
+typedef struct {
+  uint16_t    magic;
+  uint8_t     version;
+  uint8_t     count;
+  svc_entry_t entry[SVC_COUNT];
+} service_table_t;
+
+const service_table_t service_table
+  __attribute__((used, section(".svctable"))) = {
+  SVC_MAGIC, SVC_VERSION, SVC_COUNT,
+  {
+    [SVC_DISK_INITIALIZE] = (svc_entry_t)disk_initialize,
+    [SVC_DISK_READ]       = (svc_entry_t)disk_read,
+    [SVC_F_MOUNT]         = (svc_entry_t)f_mount,
+    [SVC_L_OPENROOT]      = (svc_entry_t)l_openroot,
+    [SVC_F_READDIR]       = (svc_entry_t)f_readdir,
+    [SVC_L_OPENFILE]      = (svc_entry_t)l_openfile,
+    [SVC_F_READ]          = (svc_entry_t)f_read,
+    [SVC_F_LSEEK]         = (svc_entry_t)f_lseek,
+    [SVC_CRC_CCITT_BLOCK] = (svc_entry_t)crc_ccitt_block,
+  }
+};